@@ -3,15 +3,26 @@
 #include <vector>
 #include <string>
 #include <iostream>
+#include <iterator>
+#include <sstream>
+#include <set>
+#include <map>
+#include <algorithm>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/program_options.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/format.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
 #include "output.h"
 #include "image_io.h"
 #include "imagepack.h"
+#include "parallel.h"
+#include "image_cache.h"
+#include "defs_writer.h"
+#include "defs_reader.h"
+#include "file_scan.h"
 
 #if IMAGEPACK_BUILD_HELP
     /* automatically generated by the build. */
@@ -36,6 +47,13 @@ using namespace Imagepack;
  */
 static std::vector<std::string> input_paths;
 
+/*
+ * glob patterns files must match to be packed and patterns of files and
+ * directories to skip. set on the command line.
+ */
+static std::vector<std::string> include_globs;
+static std::vector<std::string> exclude_globs;
+
 /*
  * true to read paths from stdin. Appended to input_paths.
  */
@@ -74,6 +92,31 @@ static fs::path out_dir;
  */
 static int extrude = 0;
 
+/*
+ * True to crop fully transparent rows and columns from each input image. set
+ * on the command line.
+ */
+static bool trim = false;
+
+/*
+ * Packing algorithm. cmd_algorithm is taken in on the command line and parsed
+ * to set algorithm.
+ */
+static std::string cmd_algorithm = "guillotine";
+static int         algorithm     = GUILLOTINE;
+
+/*
+ * True to try every algorithm and sort order and keep the best. set on the
+ * command line.
+ */
+static bool search = false;
+
+/*
+ * True to let sprites be turned 90 degrees when packing. set on the command
+ * line.
+ */
+static bool allow_rotation = false;
+
 /*
  * True to keep sheets a power of two. set on the command line.
  */
@@ -95,11 +138,59 @@ static bool recursive = false;
  */
 static bool dry_run = false;
 
+/*
+ * true to only read image sizes, pack them and print how many sheets would be
+ * written. set on the command line.
+ */
+static bool plan = false;
+
 /*
  * true to disable the image cache and load/unload images when necessary.
  */
 static bool no_cache = false;
 
+/*
+ * number of threads used to decode images and write sheets. 0 uses all
+ * hardware threads. set on the command line.
+ */
+static int jobs = 1;
+
+/*
+ * approximate limit in megabytes on the memory used by sheets being written at
+ * the same time. 0 for no limit. set on the command line.
+ */
+static int memory_limit = 0;
+
+/*
+ * number of rows in each band when sheets are composed and written a band at a
+ * time. 0 composes whole sheets. set on the command line.
+ */
+static int band_height = 0;
+
+/*
+ * true to write decoded images to a memory mapped temporary file and read them
+ * back from it instead of decoding them again. implies no_cache.
+ */
+static bool spill = false;
+
+/*
+ * directory to keep decoded images in between runs. empty to disable. set on
+ * the command line.
+ */
+static std::string cache_dir;
+
+/*
+ * true to reuse the layout of the previous output and only write sheets that
+ * changed. set on the command line.
+ */
+static bool incremental = false;
+
+/*
+ * content signatures of the previous output's sheets, read from the state
+ * file when incremental is set.
+ */
+static std::vector<uint64_t> previous_signatures;
+
 /*
  * true to give detailed output. set on the command line.
  */
@@ -118,20 +209,76 @@ static bool silent = false;
 static std::string cmd_tex_coord_origin = "bottom-left";
 static int         tex_coord_origin     = BOTTOM_LEFT;
 
+/*
+ * format of the definitions file. one of text, json, csv or binary. set on the
+ * command line.
+ */
+static std::string defs_format = "text";
+
 
 static void         parseCmdLine(int argc, char *argv[]);
-static void         findFiles(std::vector<fs::path> &files);
 static void         writeData();
-static std::string  getSheetDefinitions(const fs::path &path, Sheet *s);
+static void         readPreviousOutput();
+static bool         readPreviousBinaryDefinitions(const fs::path &path, std::vector<std::string> &names, std::vector<std::string> &sheets, std::vector<std::string> &rects);
+static fs::path     sheetPath(int index);
 
 static Packer packer;
 
 
+/*
+ * Composes and writes a single sheet. Called from worker threads so several
+ * sheets are composed and encoded at once. Failures are flagged in failed and
+ * reported once every worker has finished.
+ */
+struct SheetWriter
+{
+    const std::vector<int>          &indices;
+    const std::vector<fs::path>     &paths;
+    MemoryBudget                    &budget;
+    std::vector<char>               &failed;
+
+    SheetWriter(const std::vector<int> &indices, const std::vector<fs::path> &paths, MemoryBudget &budget, std::vector<char> &failed)
+        : indices(indices), paths(paths), budget(budget), failed(failed) {}
+
+    void operator()(size_t n) const
+    {
+        int i = indices[n];
+        Sheet *s = packer.getSheet(i);
+
+        /*
+         * a whole sheet is composed and copied for FreeImage. a streamed sheet
+         * only holds one band.
+         */
+        size_t bytes = static_cast<size_t>(s->width) * pixelSize(s->pixelFormat());
+
+        if(band_height > 0)
+            bytes *= std::min(band_height, s->height);
+        else
+            bytes *= s->height * 2;
+
+        budget.acquire(bytes);
+        fs::path dst = paths[i];
+
+        bool saved = band_height > 0 ? s->streamImage(dst, band_height) : s->saveImage(dst);
+        if(!saved)
+        {
+            print(format("failed to write sheet %s\n") % dst);
+            failed[n] = 1;
+        }
+
+        budget.release(bytes);
+    }
+};
+
+
 
 int main(int argc, char *argv[])
 {
     parseCmdLine(argc, argv);
     setWriteEnabled(!dry_run);
+    setJobs(jobs);
+    setImageCacheDirectory(cache_dir);
+    setFileFilters(include_globs, exclude_globs);
 
     if(silent)
         setPrintMode(SILENT);
@@ -147,111 +294,329 @@ int main(int argc, char *argv[])
     if(out_file_prepend == "." && boost::ends_with(fs::path(cmd_output).string(), "/"))
         out_file_prepend = "";
 
-    if(read_stdin)
-    {
-        std::string line;
-        while(!std::getline(std::cin, line).eof())
-            input_paths.push_back(line);
-    }
-
-    std::vector<fs::path> files;
-    findFiles(files);
-
-    print(format("%d files found\n") % files.size());
-
-    if(files.empty())
-        return EXIT_SUCCESS;
-
     packer.setSheetSize(cmd_sheet_width, cmd_sheet_height);
     packer.setTexCoordOrigin(tex_coord_origin);
     packer.setPowerOfTwo(power_of_two);
     packer.setCompact(compact);
     packer.setExtrude(extrude);
+    packer.setTrim(trim);
+    packer.setAlgorithm(algorithm);
+    packer.setSearch(search);
+    packer.setRotation(allow_rotation);
     packer.setCaching(!no_cache);
+    packer.setSpill(spill);
+    packer.setDecodeImages(!plan);
+
+    if(incremental)
+        readPreviousOutput();
+
+    std::vector<fs::path> files;
+    findFiles(input_paths, recursive, files);
 
     for(size_t i = 0; i < files.size(); i++)
-        packer.addImage(files[i].string());
+        packer.queueImage(files[i].string());
+
+    /*
+     * paths read from stdin are queued as they arrive so decoding overlaps
+     * with a slow producer.
+     */
+    size_t num_files = files.size();
+
+    if(read_stdin)
+    {
+        std::string line;
+        while(std::getline(std::cin, line))
+        {
+            /* most lines name a single file which is queued without a scan */
+            boost::system::error_code ec;
+            fs::path path(line);
+
+            if(fs::is_regular_file(path, ec))
+            {
+                if(matchFileFilters(path))
+                {
+                    packer.queueImage(line);
+                    num_files++;
+                }
+                continue;
+            }
+
+            files.clear();
+            findFiles(std::vector<std::string>(1, line), recursive, files);
+
+            for(size_t i = 0; i < files.size(); i++)
+                packer.queueImage(files[i].string());
+            num_files += files.size();
+        }
+    }
+
+    packer.finishImages();
+
+    print(format("%d files found\n") % num_files);
 
     if(packer.numImages() == 0)
         return EXIT_SUCCESS;
 
     packer.pack();
-    writeData();
-
-    return EXIT_SUCCESS;
-}
 
-void findFiles(std::vector<fs::path> &files)
-{
-    std::vector<fs::path> paths(input_paths.begin(), input_paths.end());
-
-    while(!paths.empty())
+    if(plan)
     {
-        fs::path path = paths.back();
-        paths.pop_back();
-
-        if(fs::is_regular_file(path))
-            files.push_back(path);
-        else if(fs::is_directory(path))
-        {
-            for(fs::directory_iterator it = fs::directory_iterator(path); it != fs::directory_iterator(); it++)
-                if(!fs::is_directory(it->path()) || recursive)
-                    paths.push_back(it->path());
-        }
+        packer.printOccupancy();
+        return EXIT_SUCCESS;
     }
+
+    writeData();
+
+    return EXIT_SUCCESS;
 }
 
 void writeData()
 {
-    std::string defs;
-    fs::path defs_path = out_dir / (out_file_prepend + ".defs");
+    boost::scoped_ptr<DefsEmitter> emitter(createDefsEmitter(defs_format, trim, allow_rotation));
+    DefsSink defs;
+    fs::path defs_path  = out_dir / (out_file_prepend + "." + emitter->extension());
+    fs::path state_path = out_dir / (out_file_prepend + ".state");
+    std::string state   = str(format("imagepack-state 2\ntrim %d rotation %d\n") % trim % allow_rotation);
 
     print(format("write directory   = %s\n")     % out_dir);
     print(format("write file prefix = \"%s\"\n") % out_file_prepend);
 
     if(!dry_run) fs::create_directories(out_dir);
 
+    print(format("writing definitions to %s\n") % defs_path);
+    if(!defs.open(defs_path))
+        print(format("failed to write %s\n") % defs_path, VERBOSE);
+
+    emitter->begin(defs);
+
+    std::vector<fs::path> paths;
+    std::vector<int> to_write;
+
     for(int i = 0; i < packer.numSheets(); i++)
     {
         Sheet *s         = packer.getSheet(i);
-        fs::path dst     = out_dir / str(format("%s%03d.%s") % out_file_prepend % i % "png");
+        fs::path dst     = sheetPath(i);
+        uint64_t sig     = s->signature();
+
+        paths.push_back(dst);
+        emitter->sheet(defs, i, dst, s);
+        state += str(format("%d %d %d %016x\n") % i % s->width % s->height % sig);
+
+        /*
+         * sheets left empty in the previous layout are dropped so a kept sheet
+         * can move to a lower index. its file is renamed rather than written
+         * again. indices only ever go down so the file being replaced has
+         * already been moved or is about to be rewritten.
+         */
+        int prev = s->previous_index;
+
+        if(incremental && prev >= 0 && prev < (int)previous_signatures.size() && previous_signatures[prev] == sig && fs::exists(sheetPath(prev)))
+        {
+            boost::system::error_code ec;
+
+            if(prev != i && !dry_run)
+                fs::rename(sheetPath(prev), dst, ec);
+
+            if(!ec)
+            {
+                if(prev != i)
+                    print(format("sheet %s unchanged, moved to %s\n") % sheetPath(prev) % dst);
+                else
+                    print(format("sheet %s unchanged\n") % dst);
+                continue;
+            }
+        }
 
         print(format("writing sheet to %s\n") % dst);
-        s->saveImage(dst);
-        defs += getSheetDefinitions(dst, s);
+        to_write.push_back(i);
     }
 
-    print(format("writing definitions to %s\n") % defs_path);
-    if(!dry_run)
+    /* sheets the previous run wrote beyond the new count are no longer referenced */
+    for(int i = packer.numSheets(); i < (int)previous_signatures.size(); i++)
     {
-        fs::ofstream out(defs_path);
-        out << defs;
+        if(!fs::exists(sheetPath(i)))
+            continue;
+
+        print(format("removing %s\n") % sheetPath(i));
+
+        boost::system::error_code ec;
+        if(!dry_run)
+            fs::remove(sheetPath(i), ec);
+    }
+
+    emitter->end(defs);
+    if(!defs.close())
+        print(format("failed to write %s\n") % defs_path, VERBOSE);
+
+    MemoryBudget budget(static_cast<size_t>(std::max(memory_limit, 0)) * 1024 * 1024);
+    std::vector<char> failed(to_write.size(), 0);
+    parallelFor(to_write.size(), SheetWriter(to_write, paths, budget, failed));
+
+    int num_failed = (int)std::count(failed.begin(), failed.end(), 1);
+
+    if(num_failed > 0)
+    {
+        /* a later incremental run mustn't take the failed sheets as unchanged */
+        if(incremental && !dry_run)
+        {
+            boost::system::error_code ec;
+            fs::remove(state_path, ec);
+        }
+
+        fatal(format("failed to write %d of %d sheets\n") % num_failed % to_write.size());
+    }
+
+    if(incremental && !dry_run)
+    {
+        fs::ofstream out(state_path);
+        out << state;
 
         if(out.fail())
-            print(format("failed to write %s\n") % defs_path, VERBOSE);
+            print(format("failed to write %s\n") % state_path, VERBOSE);
     }
 }
 
-std::string getSheetDefinitions(const fs::path &path, Sheet *s)
+/*
+ * Reads the definitions and state files written by a previous incremental run
+ * and passes the sheet sizes and sprite positions to the packer. Without a
+ * state file sheet sizes are read from the sheet images. The state also holds
+ * the --trim and --allow-rotation flags the text definitions were written
+ * with, since those decide how many lines each entry has, so text definitions
+ * without a state file aren't read.
+ */
+void readPreviousOutput()
 {
-    std::string out;
+    fs::path defs_path  = out_dir / (out_file_prepend + ".defs");
+    fs::path state_path = out_dir / (out_file_prepend + ".state");
+
+    std::vector< std::pair<int, int> > sizes;
+    fs::ifstream state(state_path);
+    std::string line, trim_key, rotation_key;
+    int previous_trim = 0, previous_rotation = 0;
+    bool have_layout = false;
+
+    if(std::getline(state, line) && line == "imagepack-state 2" &&
+       state >> trim_key >> previous_trim >> rotation_key >> previous_rotation && trim_key == "trim" && rotation_key == "rotation")
+    {
+        int index, w, h;
+        std::string sig;
+
+        have_layout = true;
+
+        while(state >> index >> w >> h >> sig && index == (int)sizes.size())
+        {
+            sizes.push_back(std::make_pair(w, h));
+            previous_signatures.push_back(strtoull(sig.c_str(), NULL, 16));
+        }
+    }
+
+    std::vector<std::string> names, sheets, rects;
 
-    for(size_t i = 0; i < s->images.size(); i++)
+    if(!readPreviousBinaryDefinitions(defs_path, names, sheets, rects) && fs::exists(defs_path))
     {
-        Image *img = s->images[i];
+        if(!have_layout)
+        {
+            print(format("no state file at %s to read the previous definitions with, repacking everything\n") % state_path);
+            previous_signatures.clear();
+            return;
+        }
+
+        fs::ifstream defs(defs_path);
+        std::string name, sheet, rect, coords, offsets, rotated;
 
-        for(size_t j = 0; j < img->names.size(); j++)
+        /*
+         * entries have a line of trim offsets when the previous run trimmed
+         * and then a line with the rotated flag when it allowed rotation
+         */
+        while(std::getline(defs, name) && std::getline(defs, sheet) && std::getline(defs, rect) && std::getline(defs, coords) &&
+              (!previous_trim || std::getline(defs, offsets)) && (!previous_rotation || std::getline(defs, rotated)))
         {
-            out += str(format("%s\n") % img->names[j]);
-            out += str(format("%s\n") % path.string());
-            out += str(format("%d %d %d %d\n") % (img->sheet_x + img->source_x_offset) % (img->sheet_y + img->source_y_offset) % img->source_width % img->source_height);
-            out += str(format("%f %f %f %f\n") % img->s0 % img->s1 % img->t0 % img->t1);
+            names.push_back(name);
+            sheets.push_back(sheet);
+            rects.push_back(previous_rotation ? rect + " " + rotated : rect);
         }
     }
 
-    return out;
+    if(names.empty())
+    {
+        print(format("no previous definitions found at %s\n") % defs_path);
+        previous_signatures.clear();
+        return;
+    }
+
+    if(sizes.empty())
+    {
+        std::set<std::string> distinct(sheets.begin(), sheets.end());
+
+        for(int i = 0; i < (int)distinct.size() && distinct.count(sheetPath(i).string()); i++)
+        {
+            int w = cmd_sheet_width, h = cmd_sheet_height;
+            probeImage(sheetPath(i), w, h);
+            sizes.push_back(std::make_pair(w, h));
+        }
+    }
+
+    std::map<std::string, int> sheet_index;
+    for(int i = 0; i < (int)sizes.size(); i++)
+    {
+        sheet_index[sheetPath(i).string()] = i;
+        packer.addPreviousSheet(sizes[i].first, sizes[i].second);
+    }
+
+    for(size_t i = 0; i < names.size(); i++)
+    {
+        std::map<std::string, int>::const_iterator it = sheet_index.find(sheets[i]);
+        std::istringstream in(rects[i]);
+        Placement p;
+
+        if(it == sheet_index.end() || !(in >> p.x >> p.y >> p.width >> p.height))
+            continue;
+
+        int rotated = 0;
+        in >> rotated;
+        p.rotated = rotated != 0;
+
+        p.sheet = it->second;
+        p.index = (int)i;
+        packer.addPreviousPlacement(names[i], p);
+    }
+
+    print(format("read %d previous definitions in %d sheets\n") % names.size() % sizes.size());
+}
+
+/*
+ * Reads a previous binary definitions file in to the same strings the text
+ * format is read as. Returns false if path isn't a binary definitions file.
+ */
+bool readPreviousBinaryDefinitions(const fs::path &path, std::vector<std::string> &names, std::vector<std::string> &sheets, std::vector<std::string> &rects)
+{
+    fs::ifstream in(path, std::ios::in | std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    DefsReader reader;
+    if(!reader.open(data.data(), data.size()))
+        return false;
+
+    for(uint32_t i = 0; i < reader.numSprites(); i++)
+    {
+        DefsSprite sprite;
+        DefsSheet sheet;
+
+        if(!reader.sprite(i, sprite) || !reader.sheet(sprite.sheet, sheet))
+            continue;
+
+        names.push_back(sprite.name);
+        sheets.push_back(sheet.path);
+        rects.push_back(str(format("%d %d %d %d %d") % sprite.x % sprite.y % sprite.width % sprite.height % sprite.rotated));
+    }
+
+    return true;
 }
 
+fs::path sheetPath(int index)
+{
+    return out_dir / str(format("%s%03d.%s") % out_file_prepend % index % "png");
+}
 
 void parseCmdLine(int argc, char *argv[])
 {
@@ -276,6 +641,14 @@ void parseCmdLine(int argc, char *argv[])
          opts::bool_switch(&recursive),
          "Recurse into any directories specified.\n")
 
+        ("include",
+         opts::value< std::vector<std::string> >(&include_globs),
+         "Only pack files matching this glob pattern. Can be given more than once. Example: --include '*.png'\n")
+
+        ("exclude",
+         opts::value< std::vector<std::string> >(&exclude_globs),
+         "Skip files and directories matching this glob pattern. Can be given more than once. Example: --exclude '*_old.*'\n")
+
         ("image-size,s",
          opts::value<std::string>(&cmd_img_size),
          str(format("Size of the packed images. This is a maximum size if --compact is specified and a minimum size if --power-of-two is specified. Default size is set to %s. Example: --image-size 1024x1024\n") % cmd_img_size).c_str())
@@ -288,6 +661,22 @@ void parseCmdLine(int argc, char *argv[])
          opts::value<int>(&extrude),
          "Number of pixels to extrude the edges of source images by. Example: --extrude 1. default = 0.\n")
 
+        ("trim",
+         opts::bool_switch(&trim),
+         "Crop fully transparent rows and columns from the edges of source images before packing. The trim offset and original size of each sprite are added to the definitions.\n")
+
+        ("algorithm,a",
+         opts::value<std::string>(&cmd_algorithm),
+         "Packing algorithm. One of guillotine, guillotine-shorter, guillotine-max-area, guillotine-min-area, maxrects-bssf, maxrects-baf, maxrects-cp, skyline or skyline-waste. default = guillotine.\n")
+
+        ("search",
+         opts::bool_switch(&search),
+         "Try every packing algorithm with several sort orders on worker threads and keep the layout with the fewest sheets, then the smallest area. Ties keep --algorithm.\n")
+
+        ("allow-rotation",
+         opts::bool_switch(&allow_rotation),
+         "Let sprites be turned 90 degrees clockwise when that packs them better. A rotated flag is added to the definitions.\n")
+
         ("compact,c",
          opts::bool_switch(&compact),
          "Create sheets smaller than --image-size if possible.\n")
@@ -296,14 +685,46 @@ void parseCmdLine(int argc, char *argv[])
          opts::value<std::string>(&cmd_tex_coord_origin),
          "Origin to use when computing sprite texture coordinates. Either bottom-left or top-left.\n")
 
+        ("defs-format",
+         opts::value<std::string>(&defs_format),
+         "Format of the definitions file. One of text, json, csv or binary. default = text.\n")
+
         ("dry-run,d",
          opts::bool_switch(&dry_run),
          "Don't write any files.\n")
 
+        ("incremental",
+         opts::bool_switch(&incremental),
+         "Keep sprites where they were packed by the previous run to the same output and only write sheets whose contents changed.\n")
+
+        ("plan",
+         opts::bool_switch(&plan),
+         "Print the number of sheets and how much of each is used without decoding images or writing files. Duplicate images are not detected so the sheet count is an upper bound.\n")
+
         ("no-cache",
          opts::bool_switch(&no_cache),
          "Disables caching of image data and causes images to be loaded and unloaded on demand. Useful when packing more images than can fit into memory.\n")
 
+        ("jobs,j",
+         opts::value<int>(&jobs),
+         "Number of threads used to decode images and write sheets. 0 uses one thread per hardware thread. default = 1.\n")
+
+        ("memory-limit",
+         opts::value<int>(&memory_limit),
+         "Approximate limit in megabytes on memory used by sheets being written at the same time. 0 for no limit. default = 0.\n")
+
+        ("band-height",
+         opts::value<int>(&band_height),
+         "Compose sheets this many rows at a time and stream them to the PNG encoder. Reduces memory use for very large sheets. 0 composes whole sheets. default = 0.\n")
+
+        ("spill",
+         opts::bool_switch(&spill),
+         "Write decoded images to a memory mapped temporary file and read them from there when needed instead of decoding them again. Implies --no-cache.\n")
+
+        ("cache-dir",
+         opts::value<std::string>(&cache_dir),
+         "Directory to keep decoded images in between runs. Images whose path, modification time and size are unchanged are read from here instead of being decoded.\n")
+
         ("silent,S",
          opts::bool_switch(&silent),
          "Disables printing.\n")
@@ -359,5 +780,15 @@ void parseCmdLine(int argc, char *argv[])
         tex_coord_origin = BOTTOM_LEFT;
     else if(cmd_tex_coord_origin == "top-left")
         tex_coord_origin = TOP_LEFT;
+
+    algorithm = parsePackAlgorithm(cmd_algorithm);
+    if(algorithm < 0)
+        fatal(format("unknown packing algorithm %s\n") % cmd_algorithm);
+
+    if(defs_format != "text" && defs_format != "json" && defs_format != "csv" && defs_format != "binary")
+        fatal(format("unknown definitions format %s\n") % defs_format);
+
+    if(incremental && defs_format != "text" && defs_format != "binary")
+        fatal("--incremental needs text or binary definitions\n");
 }
 
@@ -0,0 +1,196 @@
+#include <cstring>
+#include <algorithm>
+#include "output.h"
+#include "imagepack.h"
+#include "defs_binary.h"
+#include "defs_reader.h"
+
+using boost::format;
+using namespace Imagepack;
+
+namespace fs = boost::filesystem;
+
+
+namespace {
+
+/* average number of names per bucket of the perfect hash */
+const uint32_t names_per_bucket = 4;
+
+/* seeds tried for a bucket before giving up */
+const uint32_t max_seed = 1 << 24;
+
+void putU32(std::string &out, uint32_t v)
+{
+    char b[4] = { char(v & 0xff), char((v >> 8) & 0xff), char((v >> 16) & 0xff), char((v >> 24) & 0xff) };
+    out.append(b, 4);
+}
+
+void putF32(std::string &out, float f)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    putU32(out, bits);
+}
+
+uint32_t addString(std::string &strings, const std::string &s)
+{
+    uint32_t offset = static_cast<uint32_t>(strings.size());
+    strings += s;
+    strings += '\0';
+    return offset;
+}
+
+struct Bucket
+{
+    uint32_t index;
+    std::vector<uint64_t> hashes;
+    std::vector<uint32_t> sprites;
+
+    bool operator<(const Bucket &b) const
+    {
+        /* largest buckets first while most slots are free, then by index so the result is stable */
+        if(hashes.size() != b.hashes.size())
+            return hashes.size() > b.hashes.size();
+        return index < b.index;
+    }
+};
+
+/*
+ * Hash and displace: names are split in to buckets and the buckets, largest
+ * first, each search for a seed that sends all of their names to slots that
+ * are still free.
+ */
+void buildIndex(const std::vector<uint64_t> &hashes, std::vector<uint32_t> &seeds, std::vector<uint32_t> &slots)
+{
+    uint32_t n           = static_cast<uint32_t>(hashes.size());
+    uint32_t num_buckets = std::max<uint32_t>(1, (n + names_per_bucket - 1) / names_per_bucket);
+
+    std::vector<Bucket> buckets(num_buckets);
+    for(uint32_t i = 0; i < num_buckets; i++)
+        buckets[i].index = i;
+
+    for(uint32_t i = 0; i < n; i++)
+    {
+        Bucket &b = buckets[hashes[i] % num_buckets];
+        b.hashes.push_back(hashes[i]);
+        b.sprites.push_back(i);
+    }
+
+    std::sort(buckets.begin(), buckets.end());
+
+    seeds.assign(num_buckets, 0);
+    slots.assign(n, 0);
+
+    std::vector<bool> used(n, false);
+    std::vector<uint32_t> trial;
+
+    for(size_t i = 0; i < buckets.size() && !buckets[i].hashes.empty(); i++)
+    {
+        const Bucket &b = buckets[i];
+        uint32_t seed;
+
+        for(seed = 0; seed < max_seed; seed++)
+        {
+            trial.clear();
+
+            size_t j;
+            for(j = 0; j < b.hashes.size(); j++)
+            {
+                uint32_t s = DefsReader::slot(b.hashes[j], seed, n);
+                if(used[s] || std::find(trial.begin(), trial.end(), s) != trial.end())
+                    break;
+                trial.push_back(s);
+            }
+
+            if(j == b.hashes.size())
+                break;
+        }
+
+        if(seed == max_seed)
+            fatal(format("unable to build the definitions name index. two sprite names may have the same hash\n"));
+
+        seeds[b.index] = seed;
+        for(size_t j = 0; j < trial.size(); j++)
+        {
+            used[trial[j]]  = true;
+            slots[trial[j]] = b.sprites[j];
+        }
+    }
+}
+
+}
+
+
+std::string Imagepack::getBinaryDefinitions(const std::vector<fs::path> &paths, const std::vector<const Sheet*> &sheets)
+{
+    std::string strings, sheet_records, sprite_records;
+    std::vector<uint64_t> hashes;
+
+    for(size_t i = 0; i < sheets.size(); i++)
+    {
+        const Sheet *s = sheets[i];
+
+        putU32(sheet_records, addString(strings, paths[i].string()));
+        putU32(sheet_records, s->width);
+        putU32(sheet_records, s->height);
+
+        for(size_t j = 0; j < s->images.size(); j++)
+        {
+            const Image *img = s->images[j];
+
+            for(size_t k = 0; k < img->names.size(); k++)
+            {
+                const std::string &name = img->names[k];
+
+                putU32(sprite_records, addString(strings, name));
+                putU32(sprite_records, static_cast<uint32_t>(i));
+                putU32(sprite_records, img->sheet_x + img->source_x_offset);
+                putU32(sprite_records, img->sheet_y + img->source_y_offset);
+                putU32(sprite_records, img->source_width);
+                putU32(sprite_records, img->source_height);
+                putF32(sprite_records, img->s0);
+                putF32(sprite_records, img->s1);
+                putF32(sprite_records, img->t0);
+                putF32(sprite_records, img->t1);
+                putU32(sprite_records, img->trim_x);
+                putU32(sprite_records, img->trim_y);
+                putU32(sprite_records, img->original_width);
+                putU32(sprite_records, img->original_height);
+                putU32(sprite_records, img->rotated ? 1 : 0);
+
+                hashes.push_back(DefsReader::hashName(name.data(), name.size()));
+            }
+        }
+    }
+
+    std::vector<uint32_t> seeds, slots;
+    if(!hashes.empty())
+        buildIndex(hashes, seeds, slots);
+
+    uint32_t sheets_offset  = DefsReader::HEADER_SIZE;
+    uint32_t sprites_offset = sheets_offset  + static_cast<uint32_t>(sheet_records.size());
+    uint32_t seeds_offset   = sprites_offset + static_cast<uint32_t>(sprite_records.size());
+    uint32_t slots_offset   = seeds_offset   + static_cast<uint32_t>(seeds.size() * 4);
+    uint32_t strings_offset = slots_offset   + static_cast<uint32_t>(slots.size() * 4);
+
+    std::string out("IPKB");
+    putU32(out, DefsReader::VERSION);
+    putU32(out, static_cast<uint32_t>(sheets.size()));
+    putU32(out, static_cast<uint32_t>(hashes.size()));
+    putU32(out, static_cast<uint32_t>(seeds.size()));
+    putU32(out, static_cast<uint32_t>(strings.size()));
+    putU32(out, sheets_offset);
+    putU32(out, sprites_offset);
+    putU32(out, seeds_offset);
+    putU32(out, slots_offset);
+    putU32(out, strings_offset);
+    putU32(out, 0);
+
+    out += sheet_records;
+    out += sprite_records;
+    for(size_t i = 0; i < seeds.size(); i++) putU32(out, seeds[i]);
+    for(size_t i = 0; i < slots.size(); i++) putU32(out, slots[i]);
+    out += strings;
+
+    return out;
+}
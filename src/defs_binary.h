@@ -0,0 +1,21 @@
+#ifndef DEFS_BINARY_H
+#define DEFS_BINARY_H
+
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+namespace Imagepack
+{
+
+class Sheet;
+
+/*
+ * Builds a binary definitions file for sheets written to paths. The layout is
+ * described in defs_reader.h, which is also used to read it back.
+ */
+std::string getBinaryDefinitions(const std::vector<boost::filesystem::path> &paths, const std::vector<const Sheet*> &sheets);
+
+}
+
+#endif /* DEFS_BINARY_H */
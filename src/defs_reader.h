@@ -0,0 +1,256 @@
+#ifndef DEFS_READER_H
+#define DEFS_READER_H
+
+/*
+ * Header only reader for binary definitions files written with
+ * --defs-format binary. It has no dependencies beyond the standard library
+ * and can be copied in to the program loading the sheets.
+ *
+ * The file is read in place: map or load it in to memory and pass the bytes
+ * to DefsReader::open. Looking up a sprite by name hashes the name once and
+ * compares a single string; nothing is parsed or allocated.
+ *
+ * File layout. All values are little endian and 4 bytes, offsets are in bytes
+ * from the start of the file and strings are NUL terminated UTF-8 stored in
+ * the string table.
+ *
+ *     header      magic "IPKB", version, sheet count, sprite count,
+ *                 bucket count, string table size, then the offsets of the
+ *                 sheets, sprites, seeds, slots and string table and a
+ *                 reserved 0.
+ *     sheets      per sheet: path string offset, width, height.
+ *     sprites     per sprite name: name string offset, sheet index, x, y,
+ *                 width, height (int32, same as the text format), the
+ *                 texture coordinates s0, s1, t0, t1 (float32) and the trim
+ *                 offset and original size trim_x, trim_y, original_width,
+ *                 original_height (int32), then rotated, 1 if the sprite is
+ *                 turned 90 degrees clockwise in the sheet, else 0.
+ *     seeds       per bucket: the seed that maps the bucket's names to free
+ *                 slots.
+ *     slots       sprite count entries, each the index of a sprite.
+ *
+ * The seeds and slots form a minimal perfect hash of the sprite names: a name
+ * is in bucket hash % bucket count, and its sprite is in
+ * slots[slot(hash, seeds[bucket])]. Compare the name to confirm the match
+ * since names not in the file also map to a slot.
+ */
+
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+
+namespace Imagepack
+{
+
+struct DefsSheet
+{
+    const char  *path;
+    uint32_t    width;
+    uint32_t    height;
+};
+
+struct DefsSprite
+{
+    const char  *name;
+    uint32_t    sheet;
+    int32_t     x, y;
+    int32_t     width, height;
+    float       s0, s1, t0, t1;
+
+    /* offset in and size of the image before trimming. 0 and width, height if not trimmed */
+    int32_t     trim_x, trim_y;
+    int32_t     original_width, original_height;
+
+    /* 1 if the sprite covers height by width pixels turned clockwise, else 0 */
+    uint32_t    rotated;
+};
+
+class DefsReader
+{
+public:
+    enum
+    {
+        VERSION     = 3,
+        HEADER_SIZE = 48,
+        SHEET_SIZE  = 12,
+        SPRITE_SIZE = 60
+    };
+
+private:
+    const unsigned char *data;
+    size_t              size;
+    uint32_t            num_sheets;
+    uint32_t            num_sprites;
+    uint32_t            num_buckets;
+    uint32_t            strings_size;
+    uint32_t            sheets_offset;
+    uint32_t            sprites_offset;
+    uint32_t            seeds_offset;
+    uint32_t            slots_offset;
+    uint32_t            strings_offset;
+
+public:
+    DefsReader() : data(NULL), size(0), num_sheets(0), num_sprites(0), num_buckets(0) {}
+
+    /*
+     * Checks the header and that every table lies inside the data. The data
+     * must stay valid while the reader is used.
+     */
+    bool open(const void *bytes, size_t length)
+    {
+        data = static_cast<const unsigned char*>(bytes);
+        size = length;
+
+        if(!data || size < HEADER_SIZE || std::memcmp(data, "IPKB", 4) != 0 || readU32(4) != VERSION)
+            return close();
+
+        num_sheets     = readU32(8);
+        num_sprites    = readU32(12);
+        num_buckets    = readU32(16);
+        strings_size   = readU32(20);
+        sheets_offset  = readU32(24);
+        sprites_offset = readU32(28);
+        seeds_offset   = readU32(32);
+        slots_offset   = readU32(36);
+        strings_offset = readU32(40);
+
+        if(!inside(sheets_offset,  num_sheets,  SHEET_SIZE)  ||
+           !inside(sprites_offset, num_sprites, SPRITE_SIZE) ||
+           !inside(seeds_offset,   num_buckets, 4)           ||
+           !inside(slots_offset,   num_sprites, 4)           ||
+           !inside(strings_offset, strings_size, 1)          ||
+           (num_sprites > 0 && num_buckets == 0)             ||
+           (strings_size > 0 && data[strings_offset + strings_size - 1] != 0))
+            return close();
+
+        return true;
+    }
+
+    bool close()
+    {
+        data = NULL;
+        size = 0;
+        num_sheets = num_sprites = num_buckets = 0;
+        return false;
+    }
+
+    uint32_t numSheets()  const { return num_sheets;  }
+    uint32_t numSprites() const { return num_sprites; }
+
+    bool sheet(uint32_t index, DefsSheet &out) const
+    {
+        if(index >= num_sheets)
+            return false;
+
+        size_t p   = sheets_offset + static_cast<size_t>(index) * SHEET_SIZE;
+        out.path   = string(readU32(p));
+        out.width  = readU32(p + 4);
+        out.height = readU32(p + 8);
+
+        return out.path != NULL;
+    }
+
+    bool sprite(uint32_t index, DefsSprite &out) const
+    {
+        if(index >= num_sprites)
+            return false;
+
+        size_t p   = sprites_offset + static_cast<size_t>(index) * SPRITE_SIZE;
+        out.name   = string(readU32(p));
+        out.sheet  = readU32(p + 4);
+        out.x      = static_cast<int32_t>(readU32(p + 8));
+        out.y      = static_cast<int32_t>(readU32(p + 12));
+        out.width  = static_cast<int32_t>(readU32(p + 16));
+        out.height = static_cast<int32_t>(readU32(p + 20));
+        out.s0     = readF32(p + 24);
+        out.s1     = readF32(p + 28);
+        out.t0     = readF32(p + 32);
+        out.t1     = readF32(p + 36);
+
+        out.trim_x          = static_cast<int32_t>(readU32(p + 40));
+        out.trim_y          = static_cast<int32_t>(readU32(p + 44));
+        out.original_width  = static_cast<int32_t>(readU32(p + 48));
+        out.original_height = static_cast<int32_t>(readU32(p + 52));
+        out.rotated         = readU32(p + 56);
+
+        return out.name != NULL;
+    }
+
+    /*
+     * Returns the index of the sprite called name or -1 if there isn't one.
+     */
+    long find(const char *name) const
+    {
+        if(num_sprites == 0 || !name)
+            return -1;
+
+        uint64_t h      = hashName(name, std::strlen(name));
+        uint32_t seed   = readU32(seeds_offset + static_cast<size_t>(h % num_buckets) * 4);
+        uint32_t index  = readU32(slots_offset + static_cast<size_t>(slot(h, seed, num_sprites)) * 4);
+
+        if(index >= num_sprites)
+            return -1;
+
+        const char *stored = string(readU32(sprites_offset + static_cast<size_t>(index) * SPRITE_SIZE));
+        return stored && std::strcmp(stored, name) == 0 ? static_cast<long>(index) : -1;
+    }
+
+    bool find(const char *name, DefsSprite &out) const
+    {
+        long index = find(name);
+        return index >= 0 && sprite(static_cast<uint32_t>(index), out);
+    }
+
+    /* 64 bit FNV-1a */
+    static uint64_t hashName(const char *name, size_t length)
+    {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for(size_t i = 0; i < length; i++)
+        {
+            h ^= static_cast<unsigned char>(name[i]);
+            h *= 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    /* slot of a name with hash h in a bucket with the given seed */
+    static uint32_t slot(uint64_t h, uint32_t seed, uint32_t num_slots)
+    {
+        uint64_t x = h ^ (static_cast<uint64_t>(seed) * 0x9e3779b97f4a7c15ULL);
+        x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return static_cast<uint32_t>(x % num_slots);
+    }
+
+private:
+    bool inside(uint32_t offset, uint32_t count, uint32_t record_size) const
+    {
+        return offset <= size && static_cast<uint64_t>(count) * record_size <= size - offset;
+    }
+
+    uint32_t readU32(size_t p) const
+    {
+        return static_cast<uint32_t>(data[p])             |
+               static_cast<uint32_t>(data[p + 1]) <<  8   |
+               static_cast<uint32_t>(data[p + 2]) << 16   |
+               static_cast<uint32_t>(data[p + 3]) << 24;
+    }
+
+    float readF32(size_t p) const
+    {
+        uint32_t bits = readU32(p);
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+
+    const char* string(uint32_t offset) const
+    {
+        return offset < strings_size ? reinterpret_cast<const char*>(data + strings_offset + offset) : NULL;
+    }
+};
+
+} /* end namespace Imagepack */
+
+#endif /* DEFS_READER_H */
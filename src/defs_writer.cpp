@@ -0,0 +1,428 @@
+#include <cstring>
+#include "output.h"
+#include "image_io.h"
+#include "imagepack.h"
+#include "defs_writer.h"
+#include "defs_binary.h"
+
+using namespace Imagepack;
+
+namespace fs = boost::filesystem;
+
+
+namespace {
+
+/* bytes collected before they are written to the file */
+const size_t sink_buffer_size = 256 * 1024;
+
+
+/*
+ * The original four line format:
+ *     sprite name
+ *     sheet path
+ *     x y width height
+ *     s0 s1 t0 t1
+ * and when trimming a fifth line:
+ *     trim_x trim_y original_width original_height
+ * then when rotation is allowed a line of 1 if the sprite is rotated, else 0.
+ */
+class TextEmitter : public DefsEmitter
+{
+private:
+    bool trim;
+    bool rotation;
+
+public:
+    TextEmitter(bool trim, bool rotation) : trim(trim), rotation(rotation) {}
+
+    const char* extension() const { return "defs"; }
+
+    void sheet(DefsSink &out, int index, const fs::path &path, const Sheet *s)
+    {
+        (void)index;
+        std::string sheet_path = path.string();
+
+        for(size_t i = 0; i < s->images.size(); i++)
+        {
+            const Image *img = s->images[i];
+
+            for(size_t j = 0; j < img->names.size(); j++)
+            {
+                out.write(img->names[j]);
+                out.write('\n');
+                out.write(sheet_path);
+                out.write('\n');
+                out.writeInt(img->sheet_x + img->source_x_offset);
+                out.write(' ');
+                out.writeInt(img->sheet_y + img->source_y_offset);
+                out.write(' ');
+                out.writeInt(img->source_width);
+                out.write(' ');
+                out.writeInt(img->source_height);
+                out.write('\n');
+                out.writeFloat(img->s0);
+                out.write(' ');
+                out.writeFloat(img->s1);
+                out.write(' ');
+                out.writeFloat(img->t0);
+                out.write(' ');
+                out.writeFloat(img->t1);
+                out.write('\n');
+
+                if(trim)
+                {
+                    out.writeInt(img->trim_x);
+                    out.write(' ');
+                    out.writeInt(img->trim_y);
+                    out.write(' ');
+                    out.writeInt(img->original_width);
+                    out.write(' ');
+                    out.writeInt(img->original_height);
+                    out.write('\n');
+                }
+
+                if(rotation)
+                {
+                    out.writeInt(img->rotated ? 1 : 0);
+                    out.write('\n');
+                }
+            }
+        }
+    }
+};
+
+
+/*
+ * An object with an array of sheets, each with its path, size and an array
+ * of sprites.
+ */
+class JsonEmitter : public DefsEmitter
+{
+private:
+    bool trim;
+    bool rotation;
+
+public:
+    JsonEmitter(bool trim, bool rotation) : trim(trim), rotation(rotation) {}
+
+    const char* extension() const { return "json"; }
+
+    void begin(DefsSink &out)
+    {
+        out.write("{\n  \"sheets\": [");
+    }
+
+    void sheet(DefsSink &out, int index, const fs::path &path, const Sheet *s)
+    {
+        out.write(index > 0 ? ",\n    {\"path\": " : "\n    {\"path\": ");
+        writeString(out, path.string());
+        out.write(", \"width\": ");
+        out.writeInt(s->width);
+        out.write(", \"height\": ");
+        out.writeInt(s->height);
+        out.write(", \"sprites\": [");
+
+        bool first = true;
+        for(size_t i = 0; i < s->images.size(); i++)
+        {
+            const Image *img = s->images[i];
+
+            for(size_t j = 0; j < img->names.size(); j++)
+            {
+                out.write(first ? "\n      {\"name\": " : ",\n      {\"name\": ");
+                first = false;
+
+                writeString(out, img->names[j]);
+                out.write(", \"x\": ");
+                out.writeInt(img->sheet_x + img->source_x_offset);
+                out.write(", \"y\": ");
+                out.writeInt(img->sheet_y + img->source_y_offset);
+                out.write(", \"width\": ");
+                out.writeInt(img->source_width);
+                out.write(", \"height\": ");
+                out.writeInt(img->source_height);
+                out.write(", \"s0\": ");
+                out.writeFloat(img->s0);
+                out.write(", \"s1\": ");
+                out.writeFloat(img->s1);
+                out.write(", \"t0\": ");
+                out.writeFloat(img->t0);
+                out.write(", \"t1\": ");
+                out.writeFloat(img->t1);
+
+                if(trim)
+                {
+                    out.write(", \"trim_x\": ");
+                    out.writeInt(img->trim_x);
+                    out.write(", \"trim_y\": ");
+                    out.writeInt(img->trim_y);
+                    out.write(", \"original_width\": ");
+                    out.writeInt(img->original_width);
+                    out.write(", \"original_height\": ");
+                    out.writeInt(img->original_height);
+                }
+                if(rotation)
+                    out.write(img->rotated ? ", \"rotated\": true" : ", \"rotated\": false");
+                out.write('}');
+            }
+        }
+
+        out.write(first ? "]}" : "\n    ]}");
+    }
+
+    void end(DefsSink &out)
+    {
+        out.write("\n  ]\n}\n");
+    }
+
+private:
+    static void writeString(DefsSink &out, const std::string &str)
+    {
+        static const char hex[] = "0123456789abcdef";
+
+        out.write('"');
+        for(size_t i = 0; i < str.size(); i++)
+        {
+            unsigned char c = static_cast<unsigned char>(str[i]);
+
+            if(c == '"' || c == '\\')
+            {
+                out.write('\\');
+                out.write(static_cast<char>(c));
+            }
+            else if(c < 0x20)
+            {
+                char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+                out.write(esc, sizeof(esc));
+            }
+            else
+                out.write(static_cast<char>(c));
+        }
+        out.write('"');
+    }
+};
+
+
+/*
+ * One row per sprite name after a header row. Fields are quoted when they
+ * contain a comma, quote or line break.
+ */
+class CsvEmitter : public DefsEmitter
+{
+private:
+    bool trim;
+    bool rotation;
+
+public:
+    CsvEmitter(bool trim, bool rotation) : trim(trim), rotation(rotation) {}
+
+    const char* extension() const { return "csv"; }
+
+    void begin(DefsSink &out)
+    {
+        out.write("name,sheet,x,y,width,height,s0,s1,t0,t1");
+        if(trim)
+            out.write(",trim_x,trim_y,original_width,original_height");
+        if(rotation)
+            out.write(",rotated");
+        out.write('\n');
+    }
+
+    void sheet(DefsSink &out, int index, const fs::path &path, const Sheet *s)
+    {
+        (void)index;
+        std::string sheet_path = path.string();
+
+        for(size_t i = 0; i < s->images.size(); i++)
+        {
+            const Image *img = s->images[i];
+
+            for(size_t j = 0; j < img->names.size(); j++)
+            {
+                writeField(out, img->names[j]);
+                out.write(',');
+                writeField(out, sheet_path);
+                out.write(',');
+                out.writeInt(img->sheet_x + img->source_x_offset);
+                out.write(',');
+                out.writeInt(img->sheet_y + img->source_y_offset);
+                out.write(',');
+                out.writeInt(img->source_width);
+                out.write(',');
+                out.writeInt(img->source_height);
+                out.write(',');
+                out.writeFloat(img->s0);
+                out.write(',');
+                out.writeFloat(img->s1);
+                out.write(',');
+                out.writeFloat(img->t0);
+                out.write(',');
+                out.writeFloat(img->t1);
+
+                if(trim)
+                {
+                    out.write(',');
+                    out.writeInt(img->trim_x);
+                    out.write(',');
+                    out.writeInt(img->trim_y);
+                    out.write(',');
+                    out.writeInt(img->original_width);
+                    out.write(',');
+                    out.writeInt(img->original_height);
+                }
+                if(rotation)
+                {
+                    out.write(',');
+                    out.writeInt(img->rotated ? 1 : 0);
+                }
+                out.write('\n');
+            }
+        }
+    }
+
+private:
+    static void writeField(DefsSink &out, const std::string &str)
+    {
+        if(str.find_first_of(",\"\r\n") == std::string::npos)
+        {
+            out.write(str);
+            return;
+        }
+
+        out.write('"');
+        for(size_t i = 0; i < str.size(); i++)
+        {
+            if(str[i] == '"')
+                out.write('"');
+            out.write(str[i]);
+        }
+        out.write('"');
+    }
+};
+
+
+/*
+ * The perfect hash index needs every name so the binary format is built once
+ * all sheets have been given. Trim offsets and the rotated flag are always
+ * written; they are 0 and the original size is the sprite's size when
+ * trimming and rotation are off.
+ */
+class BinaryEmitter : public DefsEmitter
+{
+private:
+    std::vector<fs::path>   paths;
+    std::vector<const Sheet*> sheets;
+
+public:
+    const char* extension() const { return "defs"; }
+
+    void sheet(DefsSink &out, int index, const fs::path &path, const Sheet *s)
+    {
+        (void)out;
+        (void)index;
+        paths.push_back(path);
+        sheets.push_back(s);
+    }
+
+    void end(DefsSink &out)
+    {
+        out.write(getBinaryDefinitions(paths, sheets));
+    }
+};
+
+} /* end unnamed namespace */
+
+
+DefsSink::DefsSink()
+{
+    file   = NULL;
+    used   = 0;
+    failed = false;
+}
+
+DefsSink::~DefsSink()
+{
+    close();
+}
+
+bool DefsSink::open(const fs::path &path)
+{
+    close();
+
+    buffer.resize(sink_buffer_size);
+    used   = 0;
+    failed = false;
+
+    if(!writeEnabled())
+        return true;
+
+    file = std::fopen(path.string().c_str(), "wb");
+    failed = !file;
+
+    return !failed;
+}
+
+void DefsSink::write(const char *data, size_t size)
+{
+    if(used + size > buffer.size())
+    {
+        flush();
+
+        if(size > buffer.size())
+        {
+            if(file && std::fwrite(data, 1, size, file) != size)
+                failed = true;
+            return;
+        }
+    }
+
+    std::memcpy(&buffer[used], data, size);
+    used += size;
+}
+
+void DefsSink::writeInt(long v)
+{
+    char str[32];
+    int n = std::snprintf(str, sizeof(str), "%ld", v);
+    write(str, n);
+}
+
+void DefsSink::writeFloat(double v)
+{
+    char str[64];
+    int n = std::snprintf(str, sizeof(str), "%f", v);
+    write(str, n);
+}
+
+void DefsSink::flush()
+{
+    if(file && used > 0 && std::fwrite(&buffer[0], 1, used, file) != used)
+        failed = true;
+    used = 0;
+}
+
+bool DefsSink::close()
+{
+    flush();
+
+    if(file && std::fclose(file) != 0)
+        failed = true;
+    file = NULL;
+
+    return !failed;
+}
+
+
+DefsEmitter* Imagepack::createDefsEmitter(const std::string &format, bool trim, bool rotation)
+{
+    if(format == "text")
+        return new TextEmitter(trim, rotation);
+    if(format == "json")
+        return new JsonEmitter(trim, rotation);
+    if(format == "csv")
+        return new CsvEmitter(trim, rotation);
+    if(format == "binary")
+        return new BinaryEmitter();
+
+    return NULL;
+}
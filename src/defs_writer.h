@@ -0,0 +1,69 @@
+#ifndef DEFS_WRITER_H
+#define DEFS_WRITER_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <boost/utility.hpp>
+
+namespace Imagepack
+{
+
+class Sheet;
+
+/*
+ * Buffered output file for definitions. Nothing is written to disk if writing
+ * is disabled in image_io.
+ */
+class DefsSink : private boost::noncopyable
+{
+private:
+    FILE                *file;
+    std::vector<char>   buffer;
+    size_t              used;
+    bool                failed;
+
+public:
+                    DefsSink();
+                    ~DefsSink();
+
+    bool            open(const boost::filesystem::path &path);
+    void            write(const char *data, size_t size);
+    void            write(const std::string &str) { write(str.data(), str.size()); }
+    void            write(char c)                 { write(&c, 1); }
+    void            writeInt(long v);
+    void            writeFloat(double v);
+    bool            close();
+
+private:
+    void            flush();
+};
+
+/*
+ * Formats the definitions of each sheet as it is given. Sheets are given in
+ * order and begin and end are called once before and after all sheets.
+ */
+class DefsEmitter
+{
+public:
+    virtual                 ~DefsEmitter() {}
+
+    /* extension of the definitions file without the dot */
+    virtual const char*     extension() const = 0;
+
+    virtual void            begin(DefsSink &out) { (void)out; }
+    virtual void            sheet(DefsSink &out, int index, const boost::filesystem::path &path, const Sheet *s) = 0;
+    virtual void            end(DefsSink &out) { (void)out; }
+};
+
+/*
+ * Returns a new emitter for format (text, json, csv or binary) or NULL if the
+ * format isn't known. trim adds each sprite's trim offset and original size
+ * and rotation whether it is rotated.
+ */
+DefsEmitter* createDefsEmitter(const std::string &format, bool trim=false, bool rotation=false);
+
+}
+
+#endif /* DEFS_WRITER_H */
@@ -0,0 +1,395 @@
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include "output.h"
+#include "parallel.h"
+#include "file_scan.h"
+
+#ifndef _WIN32
+    #include <sys/types.h>
+    #include <sys/stat.h>
+    #include <dirent.h>
+#endif
+
+using boost::format;
+using namespace Imagepack;
+
+namespace fs = boost::filesystem;
+
+
+namespace {
+
+std::vector<std::string> include_patterns;
+std::vector<std::string> exclude_patterns;
+
+enum EntryType
+{
+    OTHER,
+    REGULAR,
+    DIRECTORY
+};
+
+struct DirNode;
+
+/*
+ * A file, or a directory with its node, in the order the directory listed it.
+ */
+struct Entry
+{
+    fs::path    path;
+    DirNode     *dir;
+};
+
+struct DirNode
+{
+    fs::path            path;
+    std::vector<Entry>  entries;
+};
+
+bool matchAny(const std::vector<std::string> &patterns, const fs::path &path, const std::string &name)
+{
+    for(size_t i = 0; i < patterns.size(); i++)
+    {
+        const std::string &p = patterns[i];
+        if(globMatch(p.c_str(), p.find('/') == std::string::npos ? name.c_str() : path.string().c_str()))
+            return true;
+    }
+    return false;
+}
+
+bool keepFile(const fs::path &path, const std::string &name)
+{
+    return (include_patterns.empty() || matchAny(include_patterns, path, name)) && !matchAny(exclude_patterns, path, name);
+}
+
+EntryType pathType(const fs::path &path)
+{
+    boost::system::error_code ec;
+    fs::file_status status = fs::status(path, ec);
+
+    if(fs::is_regular_file(status)) return REGULAR;
+    if(fs::is_directory(status))    return DIRECTORY;
+    return OTHER;
+}
+
+/*
+ * Lists the files and directories in path. The type of most entries comes
+ * with the listing so only links and entries of unknown type are stat'ed.
+ */
+void listDirectory(const fs::path &path, std::vector< std::pair<fs::path, EntryType> > &out)
+{
+#ifndef _WIN32
+    DIR *dir = opendir(path.string().c_str());
+
+    if(!dir)
+    {
+        print(format("unable to read directory %s\n") % path, VERBOSE);
+        return;
+    }
+
+    while(struct dirent *e = readdir(dir))
+    {
+        if(std::strcmp(e->d_name, ".") == 0 || std::strcmp(e->d_name, "..") == 0)
+            continue;
+
+        fs::path entry_path = path / e->d_name;
+        EntryType type;
+
+        switch(e->d_type)
+        {
+            case DT_REG: type = REGULAR;   break;
+            case DT_DIR: type = DIRECTORY; break;
+            case DT_LNK:
+            case DT_UNKNOWN:
+            {
+                struct stat st;
+                if(stat(entry_path.string().c_str(), &st) != 0)
+                    type = OTHER;
+                else if(S_ISREG(st.st_mode))
+                    type = REGULAR;
+                else if(S_ISDIR(st.st_mode))
+                    type = DIRECTORY;
+                else
+                    type = OTHER;
+                break;
+            }
+            default:     type = OTHER;     break;
+        }
+
+        out.push_back(std::make_pair(entry_path, type));
+    }
+
+    closedir(dir);
+#else
+    boost::system::error_code ec;
+
+    for(fs::directory_iterator it(path, ec), end; !ec && it != end; it.increment(ec))
+    {
+        fs::file_status status = it->status(ec);
+        EntryType type = ec ? OTHER : fs::is_regular_file(status) ? REGULAR : fs::is_directory(status) ? DIRECTORY : OTHER;
+        out.push_back(std::make_pair(it->path(), type));
+    }
+
+    if(ec)
+        print(format("unable to read directory %s\n") % path, VERBOSE);
+#endif
+}
+
+
+/*
+ * Scans directories on several threads. Each directory scanned queues its
+ * subdirectories so workers wait only when the queue is empty and other
+ * workers are still scanning.
+ */
+class DirWalker
+{
+private:
+    boost::mutex                mutex;
+    boost::condition_variable   changed;
+    std::deque<DirNode>         nodes;
+    std::deque<DirNode*>        queue;
+    int                         active;
+    bool                        recursive;
+
+public:
+    explicit DirWalker(bool recursive) : active(0), recursive(recursive) {}
+
+    DirNode* add(const fs::path &path)
+    {
+        nodes.push_back(DirNode());
+        nodes.back().path = path;
+        queue.push_back(&nodes.back());
+        return &nodes.back();
+    }
+
+    size_t queued() const { return queue.size(); }
+
+    /*
+     * Scans directories on the calling thread, breadth first, until count are
+     * queued or there are none left. A tree with few directories is then
+     * scanned without starting any threads.
+     */
+    void expand(size_t count)
+    {
+        std::vector< std::pair<fs::path, EntryType> > listed;
+
+        while(!queue.empty() && queue.size() < count)
+        {
+            DirNode *node = queue.front();
+            queue.pop_front();
+            scan(node, listed);
+        }
+    }
+
+    void operator()(size_t)
+    {
+        std::vector< std::pair<fs::path, EntryType> > listed;
+
+        for(;;)
+        {
+            DirNode *node;
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+
+                while(queue.empty() && active > 0)
+                    changed.wait(lock);
+
+                if(queue.empty())
+                    return;
+
+                node = queue.front();
+                queue.pop_front();
+                active++;
+            }
+
+            scan(node, listed);
+
+            {
+                boost::lock_guard<boost::mutex> lock(mutex);
+                active--;
+            }
+
+            changed.notify_all();
+        }
+    }
+
+private:
+    /* lists node and queues its subdirectories */
+    void scan(DirNode *node, std::vector< std::pair<fs::path, EntryType> > &listed)
+    {
+        listed.clear();
+        listDirectory(node->path, listed);
+
+        std::vector<Entry> entries;
+        std::vector<size_t> dirs;
+
+        for(size_t i = 0; i < listed.size(); i++)
+        {
+            const fs::path &path = listed[i].first;
+            std::string name = path.filename().string();
+            Entry e = { path, NULL };
+
+            if(listed[i].second == REGULAR && keepFile(path, name))
+                entries.push_back(e);
+            else if(listed[i].second == DIRECTORY && recursive && !matchAny(exclude_patterns, path, name))
+            {
+                dirs.push_back(entries.size());
+                entries.push_back(e);
+            }
+        }
+
+        boost::lock_guard<boost::mutex> lock(mutex);
+
+        for(size_t i = 0; i < dirs.size(); i++)
+            entries[dirs[i]].dir = add(entries[dirs[i]].path);
+
+        node->entries.swap(entries);
+    }
+};
+
+/*
+ * Adds files depth first, last entry first, the order a single threaded
+ * depth first search with a stack visits them.
+ */
+void collectFiles(const std::vector<Entry> &entries, std::vector<fs::path> &files)
+{
+    for(size_t i = entries.size(); i-- > 0;)
+    {
+        if(entries[i].dir)
+            collectFiles(entries[i].dir->entries, files);
+        else
+            files.push_back(entries[i].path);
+    }
+}
+
+} /* end unnamed namespace */
+
+
+void Imagepack::setFileFilters(const std::vector<std::string> &include, const std::vector<std::string> &exclude)
+{
+    include_patterns = include;
+    exclude_patterns = exclude;
+}
+
+bool Imagepack::matchFileFilters(const fs::path &path)
+{
+    return keepFile(path, path.filename().string());
+}
+
+bool Imagepack::globMatch(const char *p, const char *s)
+{
+    for(; *p; p++, s++)
+    {
+        if(*p == '*')
+        {
+            bool any = p[1] == '*';
+            while(*p == '*')
+                p++;
+
+            if(!*p)
+                return any || !std::strchr(s, '/');
+
+            for(;; s++)
+            {
+                if(globMatch(p, s))
+                    return true;
+                if(!*s || (*s == '/' && !any))
+                    return false;
+            }
+        }
+
+        if(!*s)
+            return false;
+
+        if(*p == '?')
+        {
+            if(*s == '/')
+                return false;
+        }
+        else if(*p == '[')
+        {
+            const char *q = p + 1;
+            bool negate  = *q == '!' || *q == '^';
+            bool matched = false;
+
+            if(negate)
+                q++;
+
+            for(const char *first = q; *q && (*q != ']' || q == first);)
+            {
+                char lo = *q, hi = *q;
+
+                if(q[1] == '-' && q[2] && q[2] != ']')
+                {
+                    hi = q[2];
+                    q += 3;
+                }
+                else
+                    q++;
+
+                if(*s >= lo && *s <= hi)
+                    matched = true;
+            }
+
+            if(!*q)
+            {
+                /* no closing bracket so '[' is an ordinary character */
+                if(*s != '[')
+                    return false;
+            }
+            else
+            {
+                if(*s == '/' || matched == negate)
+                    return false;
+                p = q;
+            }
+        }
+        else if(*p != *s)
+            return false;
+    }
+
+    return !*s;
+}
+
+void Imagepack::findFiles(const std::vector<std::string> &inputs, bool recursive, std::vector<fs::path> &files)
+{
+    DirWalker walker(recursive);
+    std::vector<Entry> entries;
+
+    for(size_t i = 0; i < inputs.size(); i++)
+    {
+        fs::path path(inputs[i]);
+        Entry e = { path, NULL };
+
+        switch(pathType(path))
+        {
+            case REGULAR:
+                if(keepFile(path, path.filename().string()))
+                    entries.push_back(e);
+                break;
+
+            case DIRECTORY:
+                e.dir = walker.add(path);
+                entries.push_back(e);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    /*
+     * a plain file, the usual input from --stdin, needs no threads. otherwise
+     * there's no point in more threads than directories waiting to be scanned
+     */
+    if(walker.queued() > 0)
+    {
+        walker.expand(numJobs());
+        parallelFor(std::min(walker.queued(), static_cast<size_t>(numJobs())), boost::ref(walker));
+    }
+
+    collectFiles(entries, files);
+}
@@ -0,0 +1,37 @@
+#ifndef FILE_SCAN_H
+#define FILE_SCAN_H
+
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+namespace Imagepack
+{
+
+/*
+ * Glob filters applied to every file found. A file is kept if it matches any
+ * include pattern (or there are none) and no exclude pattern. Directories
+ * matching an exclude pattern aren't scanned.
+ *
+ * Patterns without a '/' are matched against the file name and others
+ * against the whole path. '*' matches any run of characters other than '/',
+ * '**' also matches '/', '?' matches a single character and [abc], [a-z] and
+ * [!abc] match one character from a set.
+ */
+void setFileFilters(const std::vector<std::string> &include, const std::vector<std::string> &exclude);
+bool globMatch(const char *pattern, const char *str);
+
+/* true if the file at path passes the filters */
+bool matchFileFilters(const boost::filesystem::path &path);
+
+/*
+ * Adds the files named by inputs, and the files in any directories named by
+ * inputs, to files. Directories are scanned on numJobs() threads. The order
+ * files are added in only depends on the inputs and directory contents, not
+ * on the number of threads.
+ */
+void findFiles(const std::vector<std::string> &inputs, bool recursive, std::vector<boost::filesystem::path> &files);
+
+}
+
+#endif /* FILE_SCAN_H */
@@ -0,0 +1,182 @@
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "output.h"
+#include "imagepack.h"
+#include "image_cache.h"
+
+using boost::format;
+using namespace Imagepack;
+
+namespace fs = boost::filesystem;
+
+
+namespace {
+
+fs::path cache_dir;
+
+/* bump when the entry layout or the meaning of the pixel data changes */
+const uint32_t cache_version = 3;
+const char     cache_magic[4] = {'I', 'P', 'K', 'C'};
+
+/*
+ * Entries store pixels in the machine's byte order so they are only meant to
+ * be shared between runs on the same kind of machine.
+ */
+struct EntryHeader
+{
+    char        magic[4];
+    uint32_t    version;
+    int64_t     mtime;
+    uint64_t    file_size;
+    uint64_t    checksum;
+    int32_t     format;
+    int32_t     width;
+    int32_t     height;
+    uint32_t    path_length;
+};
+
+/*
+ * Fills in the key fields of header and returns the entry's path. Returns an
+ * empty path if the source can't be read.
+ */
+fs::path entryPath(const fs::path &path, EntryHeader &header, std::string &key)
+{
+    boost::system::error_code ec;
+    fs::path abs_path = fs::absolute(path);
+
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version   = cache_version;
+    header.mtime     = static_cast<int64_t>(fs::last_write_time(abs_path, ec));
+    if(ec) return fs::path();
+    header.file_size = static_cast<uint64_t>(fs::file_size(abs_path, ec));
+    if(ec) return fs::path();
+
+    key = abs_path.string();
+    header.path_length = static_cast<uint32_t>(key.size());
+
+    uint64_t h = hashBytes(key.data(), key.size(), header.mtime);
+    h = hashBytes(&header.file_size, sizeof(header.file_size), h);
+
+    std::string name = boost::str(format("%016x") % h);
+    return cache_dir / name.substr(0, 2) / (name + ".ipc");
+}
+
+} /* end unnamed namespace */
+
+
+namespace Imagepack {
+
+void setImageCacheDirectory(const boost::filesystem::path &dir)
+{
+    cache_dir = dir;
+}
+
+bool loadCachedImage(const boost::filesystem::path &path, PixelData &pixels, boost::uint64_t &checksum)
+{
+    if(cache_dir.empty())
+        return false;
+
+    EntryHeader expected, header;
+    std::string key;
+    fs::path entry = entryPath(path, expected, key);
+
+    if(entry.empty())
+        return false;
+
+    FILE *file = std::fopen(entry.string().c_str(), "rb");
+    if(!file)
+        return false;
+
+    bool ok = std::fread(&header, sizeof(header), 1, file) == 1 &&
+              std::memcmp(header.magic, expected.magic, sizeof(header.magic)) == 0 &&
+              header.version     == expected.version   &&
+              header.mtime       == expected.mtime     &&
+              header.file_size   == expected.file_size &&
+              header.path_length == expected.path_length &&
+              header.width > 0 && header.height > 0 &&
+              header.format >= 0 && header.format < NUM_PIXEL_FORMATS;
+
+    /* the full path guards against two sources hashing to the same entry */
+    if(ok)
+    {
+        std::vector<char> stored(key.size() + 1);
+        ok = std::fread(&stored[0], 1, key.size(), file) == key.size() && std::memcmp(&stored[0], key.data(), key.size()) == 0;
+    }
+
+    if(ok)
+    {
+        pixels.resize(header.width, header.height, header.format);
+        size_t row_bytes = pixels.rowBytes();
+
+        for(int y = 0; ok && y < pixels.height(); y++)
+            ok = std::fread(pixels.row(y), 1, row_bytes, file) == row_bytes;
+    }
+
+    std::fclose(file);
+
+    if(!ok)
+    {
+        pixels.resize(0, 0);
+        return false;
+    }
+
+    print(format("loaded %s from cache\n") % path, VERBOSE);
+    checksum = header.checksum;
+    return true;
+}
+
+/*
+ * Entries are written to a temporary name and renamed into place so a reader
+ * never sees a partially written entry.
+ */
+void storeCachedImage(const boost::filesystem::path &path, const PixelData &pixels, boost::uint64_t checksum)
+{
+    if(cache_dir.empty())
+        return;
+
+    EntryHeader header;
+    std::string key;
+    fs::path entry = entryPath(path, header, key);
+
+    if(entry.empty())
+        return;
+
+    header.checksum = checksum;
+    header.format   = pixels.format();
+    header.width    = pixels.width();
+    header.height   = pixels.height();
+
+    boost::system::error_code ec;
+    fs::create_directories(entry.parent_path(), ec);
+
+    fs::path tmp = entry.parent_path() / fs::unique_path("%%%%-%%%%-%%%%.tmp");
+    FILE *file = std::fopen(tmp.string().c_str(), "wb");
+
+    if(!file)
+    {
+        print(format("failed to write cache entry %s\n") % entry, VERBOSE);
+        return;
+    }
+
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+              std::fwrite(key.data(), 1, key.size(), file) == key.size();
+
+    size_t row_bytes = pixels.rowBytes();
+    for(int y = 0; ok && y < pixels.height(); y++)
+        ok = std::fwrite(pixels.row(y), 1, row_bytes, file) == row_bytes;
+
+    ok = std::fclose(file) == 0 && ok;
+
+    if(ok)
+        fs::rename(tmp, entry, ec);
+
+    if(!ok || ec)
+    {
+        print(format("failed to write cache entry %s\n") % entry, VERBOSE);
+        fs::remove(tmp, ec);
+    }
+}
+
+} /* end namespace Imagepack */
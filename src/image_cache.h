@@ -0,0 +1,23 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <boost/filesystem.hpp>
+#include <boost/cstdint.hpp>
+
+namespace Imagepack
+{
+
+class PixelData;
+
+/*
+ * A directory of decoded images kept between runs. Entries are keyed by the
+ * source file's path, modification time and size so a changed file is
+ * decoded again. An empty directory disables the cache.
+ */
+void setImageCacheDirectory(const boost::filesystem::path &dir);
+bool loadCachedImage(const boost::filesystem::path &path, PixelData &pixels, boost::uint64_t &checksum);
+void storeCachedImage(const boost::filesystem::path &path, const PixelData &pixels, boost::uint64_t checksum);
+
+}
+
+#endif /* IMAGE_CACHE_H */
@@ -7,9 +7,13 @@
 #endif
 
 #include <FreeImage.h>
+#include <cstring>
+#include <boost/thread/once.hpp>
+#include <boost/static_assert.hpp>
 #include "output.h"
 #include "imagepack.h"
 #include "image_io.h"
+#include "png_writer.h"
 
 #if _WIN32
     #define IMAGEPACK_FreeImage_GetFileType(a, b)       FreeImage_GetFileTypeU((a), (b))
@@ -23,12 +27,30 @@
     #define IMAGEPACK_FreeImage_Save(a, b, c, d)        FreeImage_Save((a), (b), (c), (d))
 #endif
 
+/*
+ * x86 always has SSE2 on 64 bit builds. AVX2 is used when the compiler is
+ * allowed to, e.g. with -mavx2 or -march=native.
+ */
+#if defined(__AVX2__)
+    #include <immintrin.h>
+    #define IMAGEPACK_AVX2 1
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define IMAGEPACK_SSE2 1
+#endif
+
 using boost::format;
+using Imagepack::Pixel;
 
 namespace {
 
+/* the conversion kernels treat a Pixel as its packed 0xRRGGBBAA value */
+BOOST_STATIC_ASSERT(sizeof(Pixel) == sizeof(uint32_t));
+
 bool write_enabled = true;
-bool initialized   = false;
+boost::once_flag initialized = BOOST_ONCE_INIT;
 
 void FreeImageErrorHandler(FREE_IMAGE_FORMAT fif, const char *message)
 {
@@ -40,11 +62,173 @@ void FreeImageErrorHandler(FREE_IMAGE_FORMAT fif, const char *message)
     Imagepack::print(format(": %s\n") % message, Imagepack::VERBOSE);
 }
 
-void ensureInitialized()
+void initialize()
 {
-    if(initialized) return;
     FreeImage_SetOutputMessage(FreeImageErrorHandler);
-    initialized = true;
+}
+
+/* images can be loaded from several threads at once */
+void ensureInitialized()
+{
+    boost::call_once(initialized, initialize);
+}
+
+/*
+ * Scanline conversion between FreeImage's 32 bit layout and Pixel.
+ *
+ * With the BGR colour order, a FreeImage pixel read as a little endian
+ * uint32_t is 0xAARRGGBB while a Pixel is 0xRRGGBBAA, so converting either
+ * way is a rotate by 8 bits which vectorizes to two shifts and an or. Other
+ * layouts go through the scalar loop which uses the FI_RGBA_* byte offsets.
+ */
+#if FREEIMAGE_COLORORDER == FREEIMAGE_COLORORDER_BGR && (IMAGEPACK_SSE2 || IMAGEPACK_AVX2)
+    #define IMAGEPACK_SIMD_CONVERT 1
+#endif
+
+void convertScanlineToPixels(const BYTE *src, Pixel *dst, int n)
+{
+    uint32_t *out = reinterpret_cast<uint32_t*>(dst);
+    int i = 0;
+
+#if IMAGEPACK_SIMD_CONVERT && IMAGEPACK_AVX2
+    for(; i + 8 <= n; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i*4));
+        v = _mm256_or_si256(_mm256_slli_epi32(v, 8), _mm256_srli_epi32(v, 24));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), v);
+    }
+#endif
+
+#if IMAGEPACK_SIMD_CONVERT && IMAGEPACK_SSE2
+    for(; i + 4 <= n; i += 4)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i*4));
+        v = _mm_or_si128(_mm_slli_epi32(v, 8), _mm_srli_epi32(v, 24));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), v);
+    }
+#endif
+
+    for(; i < n; i++)
+    {
+        const BYTE *bits = src + i*4;
+        out[i] = (static_cast<uint32_t>(bits[FI_RGBA_RED])   << 24) |
+                 (static_cast<uint32_t>(bits[FI_RGBA_GREEN]) << 16) |
+                 (static_cast<uint32_t>(bits[FI_RGBA_BLUE])  <<  8) |
+                 (static_cast<uint32_t>(bits[FI_RGBA_ALPHA]) <<  0);
+    }
+}
+
+void convertPixelsToScanline(const Pixel *src, BYTE *dst, int n)
+{
+    const uint32_t *in = reinterpret_cast<const uint32_t*>(src);
+    int i = 0;
+
+#if IMAGEPACK_SIMD_CONVERT && IMAGEPACK_AVX2
+    for(; i + 8 <= n; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        v = _mm256_or_si256(_mm256_srli_epi32(v, 8), _mm256_slli_epi32(v, 24));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i*4), v);
+    }
+#endif
+
+#if IMAGEPACK_SIMD_CONVERT && IMAGEPACK_SSE2
+    for(; i + 4 <= n; i += 4)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        v = _mm_or_si128(_mm_srli_epi32(v, 8), _mm_slli_epi32(v, 24));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i*4), v);
+    }
+#endif
+
+    for(; i < n; i++)
+    {
+        BYTE *bits = dst + i*4;
+        bits[FI_RGBA_RED]   = static_cast<BYTE>(in[i] >> 24);
+        bits[FI_RGBA_GREEN] = static_cast<BYTE>(in[i] >> 16);
+        bits[FI_RGBA_BLUE]  = static_cast<BYTE>(in[i] >>  8);
+        bits[FI_RGBA_ALPHA] = static_cast<BYTE>(in[i] >>  0);
+    }
+}
+
+/*
+ * Returns the format of the image at path or FIF_UNKNOWN if it can't be read.
+ */
+FREE_IMAGE_FORMAT readableFormat(const boost::filesystem::path &path)
+{
+    FREE_IMAGE_FORMAT fif = IMAGEPACK_FreeImage_GetFileType(path.c_str(), 0);
+
+    if(fif == FIF_UNKNOWN)
+		fif = IMAGEPACK_FreeImage_GetFIFFromFilename(path.c_str());
+
+    if(fif == FIF_UNKNOWN || !FreeImage_FIFSupportsReading(fif))
+    {
+        Imagepack::print("format not supported or not an image file\n", Imagepack::VERBOSE);
+        return FIF_UNKNOWN;
+    }
+
+    return fif;
+}
+
+/*
+ * Readers for each source layout. FreeImage stores rows bottom up.
+ */
+bool readRgba8(FIBITMAP *dib, Imagepack::PixelData &pixels)
+{
+    FIBITMAP *img = FreeImage_ConvertTo32Bits(dib);
+
+    if(!img)
+    {
+        Imagepack::print("failed to convert image to 32bits\n", Imagepack::VERBOSE);
+        return false;
+    }
+
+    pixels.resize(FreeImage_GetWidth(img), FreeImage_GetHeight(img), Imagepack::RGBA8);
+
+    for(int y = 0, h = pixels.height(); y < h; y++)
+        convertScanlineToPixels(FreeImage_GetScanLine(img, h-y-1), reinterpret_cast<Pixel*>(pixels.row(y)), pixels.width());
+
+    FreeImage_Unload(img);
+    return true;
+}
+
+bool readGray8(FIBITMAP *dib, Imagepack::PixelData &pixels)
+{
+    FIBITMAP *img = FreeImage_ConvertTo8Bits(dib);
+
+    if(!img)
+    {
+        Imagepack::print("failed to convert image to 8bits\n", Imagepack::VERBOSE);
+        return false;
+    }
+
+    pixels.resize(FreeImage_GetWidth(img), FreeImage_GetHeight(img), Imagepack::GRAY8);
+
+    for(int y = 0, h = pixels.height(); y < h; y++)
+        std::memcpy(pixels.row(y), FreeImage_GetScanLine(img, h-y-1), pixels.rowBytes());
+
+    FreeImage_Unload(img);
+    return true;
+}
+
+/* FIRGBA16 is red, green, blue, alpha in that order for any colour order */
+bool readRgba16(FIBITMAP *dib, Imagepack::PixelData &pixels)
+{
+    FIBITMAP *img = FreeImage_ConvertToType(dib, FIT_RGBA16, TRUE);
+
+    if(!img)
+    {
+        Imagepack::print("failed to convert image to 16 bit RGBA\n", Imagepack::VERBOSE);
+        return false;
+    }
+
+    pixels.resize(FreeImage_GetWidth(img), FreeImage_GetHeight(img), Imagepack::RGBA16);
+
+    for(int y = 0, h = pixels.height(); y < h; y++)
+        std::memcpy(pixels.row(y), FreeImage_GetScanLine(img, h-y-1), pixels.rowBytes());
+
+    FreeImage_Unload(img);
+    return true;
 }
 
 } /* end unnamed namespace */
@@ -58,21 +242,20 @@ void setWriteEnabled(bool enabled)
     write_enabled = enabled;
 }
 
+bool writeEnabled()
+{
+    return write_enabled;
+}
+
 bool loadImage(const boost::filesystem::path &path, PixelData &pixels)
 {
     ensureInitialized();
     print(format("loading image %s\n") % path, VERBOSE);
 
-    FREE_IMAGE_FORMAT fif = IMAGEPACK_FreeImage_GetFileType(path.c_str(), 0);
+    FREE_IMAGE_FORMAT fif = readableFormat(path);
 
     if(fif == FIF_UNKNOWN)
-		fif = IMAGEPACK_FreeImage_GetFIFFromFilename(path.c_str());
-
-    if(fif == FIF_UNKNOWN || !FreeImage_FIFSupportsReading(fif))
-    {
-        print("format not supported or not an image file\n", VERBOSE);
         return false;
-    }
 
     FIBITMAP *dib = IMAGEPACK_FreeImage_Load(fif, path.c_str(), 0);
 
@@ -89,59 +272,94 @@ bool loadImage(const boost::filesystem::path &path, PixelData &pixels)
         return false;
     }
 
-    FIBITMAP *img = FreeImage_ConvertTo32Bits(dib);
+    /*
+     * images are read in the format closest to the source and then narrowed
+     * to the smallest format that holds their pixels exactly.
+     */
+    FREE_IMAGE_TYPE type = FreeImage_GetImageType(dib);
+    bool loaded;
+
+    if(type == FIT_UINT16 || type == FIT_RGB16 || type == FIT_RGBA16)
+        loaded = readRgba16(dib, pixels);
+    else if(type == FIT_BITMAP && FreeImage_GetBPP(dib) <= 8 && FreeImage_GetColorType(dib) == FIC_MINISBLACK && !FreeImage_IsTransparent(dib))
+        loaded = readGray8(dib, pixels);
+    else
+        loaded = readRgba8(dib, pixels);
+
     FreeImage_Unload(dib);
 
-    if(!img)
-    {
-        print("failed to convert image to 32bits\n", VERBOSE);
-        return false;
-    }
+    if(loaded)
+        pixels.convert(pixels.narrowestFormat());
 
-    int bytes_per_pixel = FreeImage_GetLine(img) / FreeImage_GetWidth(img);
-    pixels.resize(FreeImage_GetWidth(img), FreeImage_GetHeight(img));
+    return loaded;
+}
 
-    for(int y = 0, h = pixels.height(); y < h; y++)
-    {
-        BYTE *bits = FreeImage_GetScanLine(img, h-y-1);
+/*
+ * Reads only the image header when FreeImage supports it (3.16 and later)
+ * rather than decoding the pixels. Older versions fall back to a full load.
+ */
+bool probeImage(const boost::filesystem::path &path, int &width, int &height)
+{
+    ensureInitialized();
+    print(format("probing image %s\n") % path, VERBOSE);
 
-        for(int x = 0, w = pixels.width(); x < w; x++)
-        {
-            float r = bits[FI_RGBA_RED]   / 255.0f;
-            float g = bits[FI_RGBA_GREEN] / 255.0f;
-            float b = bits[FI_RGBA_BLUE]  / 255.0f;
-            float a = bits[FI_RGBA_ALPHA] / 255.0f;
+    FREE_IMAGE_FORMAT fif = readableFormat(path);
 
-            pixels.set(x, y, r, g, b, a);
-            bits += bytes_per_pixel;
-        }
+    if(fif == FIF_UNKNOWN)
+        return false;
+
+#ifdef FIF_LOAD_NOPIXELS
+    FIBITMAP *dib = IMAGEPACK_FreeImage_Load(fif, path.c_str(), FIF_LOAD_NOPIXELS);
+#else
+    FIBITMAP *dib = IMAGEPACK_FreeImage_Load(fif, path.c_str(), 0);
+#endif
+
+    if(!dib)
+    {
+        print("failed to load image header\n", VERBOSE);
+        return false;
     }
 
-    FreeImage_Unload(img);
+    width  = FreeImage_GetWidth(dib);
+    height = FreeImage_GetHeight(dib);
+
+    FreeImage_Unload(dib);
     return true;
 }
 
+/*
+ * FreeImage has no gray and alpha bitmaps so those are written directly.
+ */
 bool saveImage(const boost::filesystem::path &path, PixelData &pixels)
 {
+    if(pixels.format() == GRAY_ALPHA8)
+    {
+        PngWriter writer;
+        return writer.open(path, pixels.width(), pixels.height(), pixels.format()) &&
+               writer.writeRows(pixels, 0, pixels.height()) &&
+               writer.close();
+    }
+
     ensureInitialized();
-    FIBITMAP *dib = FreeImage_Allocate(pixels.width(), pixels.height(), 32);
+    FIBITMAP *dib;
+
+    if(pixels.format() == GRAY8)
+        dib = FreeImage_Allocate(pixels.width(), pixels.height(), 8);
+    else if(pixels.format() == RGBA16)
+        dib = FreeImage_AllocateT(FIT_RGBA16, pixels.width(), pixels.height(), 64);
+    else
+        dib = FreeImage_Allocate(pixels.width(), pixels.height(), 32);
 
     if(!dib)
         return false;
 
-    for(int y = 0; y < pixels.height(); y++)
+    for(int y = 0, h = pixels.height(); y < h; y++)
     {
-        BYTE *bits = FreeImage_GetScanLine(dib, pixels.height()-y-1);
-
-        for(int x = 0; x < pixels.width(); x++)
-        {
-            bits[FI_RGBA_RED]   = pixels.get(x, y).redByte();
-            bits[FI_RGBA_GREEN] = pixels.get(x, y).greenByte();
-            bits[FI_RGBA_BLUE]  = pixels.get(x, y).blueByte();
-            bits[FI_RGBA_ALPHA] = pixels.get(x, y).alphaByte();
-
-            bits += 4;
-        }
+        /* FreeImage's FIRGBA16 and an 8 bit greyscale bitmap have the same layout as PixelData */
+        if(pixels.format() == RGBA8)
+            convertPixelsToScanline(reinterpret_cast<const Pixel*>(pixels.row(y)), FreeImage_GetScanLine(dib, h-y-1), pixels.width());
+        else
+            std::memcpy(FreeImage_GetScanLine(dib, h-y-1), pixels.row(y), pixels.rowBytes());
     }
 
     print(format("writing %s\n") % path, VERBOSE);
@@ -150,6 +368,7 @@ bool saveImage(const boost::filesystem::path &path, PixelData &pixels)
         if(!IMAGEPACK_FreeImage_Save(FIF_PNG, dib, path.c_str(), 0))
         {
             print("failed to write image\n", VERBOSE);
+            FreeImage_Unload(dib);
             return false;
         }
 
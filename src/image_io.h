@@ -9,7 +9,9 @@ namespace Imagepack
 class PixelData;
 
 void setWriteEnabled(bool enabled);
+bool writeEnabled();
 bool loadImage(const boost::filesystem::path &path, PixelData &pixels);
+bool probeImage(const boost::filesystem::path &path, int &width, int &height);
 bool saveImage(const boost::filesystem::path &path, PixelData &pixels);
 
 }
@@ -1,8 +1,20 @@
 #include <cstdio>
 #include <algorithm>
-#include <boost/crc.hpp>
+#include <cstring>
+#include <deque>
+#include <new>
+#include <boost/bind/bind.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define IMAGEPACK_SSE2 1
+#endif
 #include "output.h"
 #include "image_io.h"
+#include "parallel.h"
+#include "png_writer.h"
+#include "spill.h"
+#include "image_cache.h"
 #include "imagepack.h"
 
 using boost::format;
@@ -11,12 +23,499 @@ using namespace Imagepack;
 
 namespace {
 
-bool imageHeightCompare(Image *a, Image *b) { return a->height > b->height; }
-bool imageWidthCompare(Image *a, Image *b)  { return a->width > b->width;   }
+bool imageSheetYCompare(Image *a, Image *b) { return a->sheet_y < b->sheet_y; }
+
+bool imagePositionCompare(Image *a, Image *b)
+{
+    return a->sheet_y < b->sheet_y || (a->sheet_y == b->sheet_y && a->sheet_x < b->sheet_x);
+}
+
+bool placementIndexCompare(const std::pair<Placement, Image*> &a, const std::pair<Placement, Image*> &b)
+{
+    return a.first.index < b.first.index;
+}
+
+boost::format reloadFailure(const Image *img)
+{
+    return format("failed to reload '%s'. File changed or removed?\n") % img->names[0];
+}
+
+/*
+ * Sort orders for packing, biggest first by a primary key, then by width and
+ * height. Ties keep the order images were added. Keys are packed in to 64 bits
+ * so an order is at most two radix sorts.
+ */
+const char *sort_order_names[NUM_SORT_ORDERS] = {"width", "height", "area", "longest side", "perimeter"};
+
+struct SortEntry
+{
+    uint64_t    key;
+    Image       *img;
+};
+
+uint64_t packKey(uint32_t high, uint32_t low)
+{
+    return static_cast<uint64_t>(high) << 32 | low;
+}
+
+/*
+ * Stable sort on key, biggest first. Sorts a byte at a time from the least
+ * significant and skips bytes that are the same in every key, which for
+ * sprites under 65536 pixels a side is most of them.
+ */
+void radixSort(std::vector<SortEntry> &entries, std::vector<SortEntry> &scratch)
+{
+    uint64_t all_or  = 0;
+    uint64_t all_and = ~static_cast<uint64_t>(0);
+
+    for(size_t i = 0, n = entries.size(); i < n; i++)
+    {
+        all_or  |= entries[i].key;
+        all_and &= entries[i].key;
+    }
+
+    scratch.resize(entries.size());
+
+    for(int shift = 0; shift < 64; shift += 8)
+    {
+        if((((all_or ^ all_and) >> shift) & 0xff) == 0)
+            continue;
+
+        size_t offsets[256] = {0};
+
+        /* counting on the inverted byte puts bigger keys first */
+        for(size_t i = 0, n = entries.size(); i < n; i++)
+            offsets[0xff - ((entries[i].key >> shift) & 0xff)]++;
+
+        for(size_t b = 0, total = 0; b < 256; b++)
+        {
+            size_t count = offsets[b];
+            offsets[b] = total;
+            total += count;
+        }
+
+        for(size_t i = 0, n = entries.size(); i < n; i++)
+            scratch[offsets[0xff - ((entries[i].key >> shift) & 0xff)]++] = entries[i];
+
+        entries.swap(scratch);
+    }
+}
+
+void sortForPacking(std::vector<Image*> &images, int order)
+{
+    size_t n = images.size();
+    std::vector<SortEntry> entries(n);
+    std::vector<SortEntry> scratch;
+
+    for(size_t i = 0; i < n; i++)
+    {
+        Image *img = images[i];
+        entries[i].img = img;
+
+        switch(order)
+        {
+            case SORT_HEIGHT:
+                entries[i].key = packKey(img->height, img->width);
+                break;
+            case SORT_MAX_SIDE:
+                entries[i].key = packKey(std::max(img->width, img->height), std::min(img->width, img->height));
+                break;
+            default:
+                entries[i].key = packKey(img->width, img->height);
+                break;
+        }
+    }
+
+    radixSort(entries, scratch);
+
+    /* area and perimeter are sorted again, keeping the order by width and height on a tie */
+    if(order == SORT_AREA || order == SORT_PERIMETER)
+    {
+        for(size_t i = 0; i < n; i++)
+        {
+            const Image *img = entries[i].img;
+
+            if(order == SORT_AREA)
+                entries[i].key = static_cast<uint64_t>(img->width) * img->height;
+            else
+                entries[i].key = static_cast<uint64_t>(img->width) + img->height;
+        }
+
+        radixSort(entries, scratch);
+    }
+
+    for(size_t i = 0; i < n; i++)
+        images[i] = entries[i].img;
+}
+
+/*
+ * Packs images on to as many trial sheets as they need once for each pair of
+ * algorithm and sort order. Like CompactSearch the trials only run pack
+ * engines so they can run at once.
+ */
+struct PortfolioSearch
+{
+    struct Trial
+    {
+        int         algorithm;
+        int         order;
+        int         num_sheets;
+
+        /* sum of the bounding boxes of the images on each sheet */
+        uint64_t    area;
+    };
+
+    int                                 sheet_width, sheet_height;
+    bool                                allow_rotation;
+    std::vector< std::vector<Image*> >  sorted;
+    std::vector<Trial>                  trials;
+
+    PortfolioSearch(int width, int height, bool allow_rotation)
+        : sheet_width(width), sheet_height(height), allow_rotation(allow_rotation), sorted(NUM_SORT_ORDERS) {}
+
+    void addTrial(int algorithm, int order)
+    {
+        Trial t = {algorithm, order, 0, 0};
+        trials.push_back(t);
+    }
+
+    void operator()(size_t i)
+    {
+        Trial &t = trials[i];
+        std::vector<Image*> remaining(sorted[t.order]);
+        std::vector<Image*> rest;
+
+        while(!remaining.empty())
+        {
+            boost::scoped_ptr<PackEngine> engine(createPackEngine(t.algorithm, sheet_width, sheet_height, allow_rotation));
+            int right  = 0;
+            int bottom = 0;
+
+            rest.clear();
+
+            for(size_t j = 0, n = remaining.size(); j < n; j++)
+            {
+                Image *img = remaining[j];
+                int x, y;
+                bool rotated;
+
+                if(engine->insert(img->width, img->height, x, y, rotated))
+                {
+                    right  = std::max(right,  x + (rotated ? img->height : img->width));
+                    bottom = std::max(bottom, y + (rotated ? img->width : img->height));
+                }
+                else
+                    rest.push_back(img);
+            }
+
+            /* what is left doesn't fit an empty sheet */
+            if(rest.size() == remaining.size())
+                break;
+
+            t.num_sheets++;
+            t.area += static_cast<uint64_t>(right) * bottom;
+            remaining.swap(rest);
+        }
+    }
+
+    /* fewest sheets, then smallest area. ties go to the earlier trial */
+    const Trial& best() const
+    {
+        size_t b = 0;
+
+        for(size_t i = 1; i < trials.size(); i++)
+            if(trials[i].num_sheets < trials[b].num_sheets || (trials[i].num_sheets == trials[b].num_sheets && trials[i].area < trials[b].area))
+                b = i;
+
+        return trials[b];
+    }
+};
+
+/*
+ * Finds the smallest sheet the images of a compact sheet fit by packing them
+ * into trial sheets. Trials only run a pack engine, so they don't touch the
+ * images and several can run at once. The images must already be sorted.
+ *
+ * Whether the images fit isn't strictly monotone in the sheet size, since the
+ * engines split free space differently depending on its shape, so the result
+ * is the smallest size found rather than a proven minimum.
+ */
+struct CompactSearch
+{
+    enum
+    {
+        MAX_TRIAL_WIDTHS = 64,
+
+        /* candidates that don't fit tried below a bisection result before giving up */
+        MAX_STEP_DOWN    = 16
+    };
+
+    const std::vector<Image*>   &images;
+    int                         algorithm;
+    bool                        allow_rotation;
+    uint64_t                    area;
+
+    /* candidate sizes in increasing order */
+    std::vector<int>            widths;
+    std::vector<int>            heights;
+
+    /*
+     * widths searched in parallel and the smallest height found for each.
+     * operator() runs trials from trial_offset on.
+     */
+    std::vector<int>            trial_widths;
+    std::vector<int>            trial_heights;
+    size_t                      trial_offset;
+
+    CompactSearch(const std::vector<Image*> &images, int algorithm, bool allow_rotation)
+        : images(images), algorithm(algorithm), allow_rotation(allow_rotation), area(0), trial_offset(0)
+    {
+        for(size_t i = 0; i < images.size(); i++)
+            area += static_cast<uint64_t>(images[i]->width) * images[i]->height;
+    }
+
+    bool fits(int width, int height) const
+    {
+        if(static_cast<uint64_t>(width) * height < area)
+            return false;
+
+        boost::scoped_ptr<PackEngine> engine(createPackEngine(algorithm, width, height, allow_rotation));
+        int x, y;
+        bool rotated;
+
+        for(size_t i = 0, n = images.size(); i < n; i++)
+            if(!engine->insert(images[i]->width, images[i]->height, x, y, rotated))
+                return false;
+
+        return true;
+    }
+
+    bool fits(const std::vector<int> &sizes, int index, int other, bool vary_width) const
+    {
+        return vary_width ? fits(sizes[index], other) : fits(other, sizes[index]);
+    }
+
+    /*
+     * Binary search for the first candidate the images fit, with the other
+     * dimension fixed, then a few steps down from there in case a smaller
+     * candidate fits after one that didn't. Returns -1 if they don't fit the
+     * last candidate.
+     */
+    int search(const std::vector<int> &sizes, int other, bool vary_width) const
+    {
+        int lo = 0;
+        int hi = static_cast<int>(sizes.size()) - 1;
+
+        if(hi < 0 || !fits(sizes, hi, other, vary_width))
+            return -1;
+
+        while(lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+
+            if(fits(sizes, mid, other, vary_width))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+
+        for(int i = hi - 1, misses = 0; i >= 0 && misses < MAX_STEP_DOWN; i--)
+        {
+            if(fits(sizes, i, other, vary_width))
+            {
+                hi     = i;
+                misses = 0;
+            }
+            else
+                misses++;
+        }
+
+        return hi;
+    }
+
+    void operator()(size_t i)
+    {
+        i += trial_offset;
+
+        int h = search(heights, trial_widths[i], false);
+        trial_heights[i] = h < 0 ? 0 : heights[h];
+    }
+
+    /*
+     * Finds the smallest height for up to MAX_TRIAL_WIDTHS widths spread over
+     * every candidate. The widths between the best one and its tried
+     * neighbours are then sampled the same way until every width around the
+     * best has been tried, so the result is as precise as a search of every
+     * width near it. Returns false if the images don't fit the largest size.
+     */
+    bool run(int &width, int &height)
+    {
+        int last = static_cast<int>(widths.size()) - 1;
+
+        if(last < 0 || heights.empty() || !fits(widths[last], heights.back()))
+            return false;
+
+        std::vector<char> tried(widths.size(), 0);
+        int lo = 0;
+        int hi = last;
+        uint64_t best = 0;
+
+        for(;;)
+        {
+            trial_offset = trial_widths.size();
+
+            int n = hi - lo + 1;
+
+            for(int k = 0, count = std::min<int>(n, MAX_TRIAL_WIDTHS); k < count; k++)
+            {
+                int index = lo + (count > 1 ? k * (n - 1) / (count - 1) : 0);
+
+                if(!tried[index])
+                {
+                    tried[index] = 1;
+                    trial_widths.push_back(widths[index]);
+                }
+            }
+
+            if(trial_widths.size() == trial_offset)
+                break;
+
+            trial_heights.resize(trial_widths.size(), 0);
+            parallelFor(trial_widths.size() - trial_offset, boost::ref(*this));
+
+            /* smallest area, the narrowest on a tie */
+            for(size_t i = trial_offset; i < trial_widths.size(); i++)
+            {
+                uint64_t a = static_cast<uint64_t>(trial_widths[i]) * trial_heights[i];
+
+                if(trial_heights[i] > 0 && (best == 0 || a < best || (a == best && trial_widths[i] < width)))
+                {
+                    best   = a;
+                    width  = trial_widths[i];
+                    height = trial_heights[i];
+                }
+            }
+
+            if(best == 0)
+                break;
+
+            /* the untried widths either side of the best */
+            int b = static_cast<int>(std::lower_bound(widths.begin(), widths.end(), width) - widths.begin());
+
+            for(lo = b; lo > 0 && !tried[lo - 1]; lo--) {}
+            for(hi = b; hi < last && !tried[hi + 1]; hi++) {}
+        }
+
+        return best > 0;
+    }
+};
+
+/*
+ * Sets count pixels of size bytes each to the pixel at value. Extruded edges
+ * are runs of a single pixel so they are stored 16 bytes at a time. Pixel
+ * sizes divide 16 so the pattern lines up from one store to the next.
+ */
+void fillPixels(uint8_t *dst, const uint8_t *value, int size, int count)
+{
+    size_t n = static_cast<size_t>(count) * size;
+    size_t i = 0;
+
+#if IMAGEPACK_SSE2
+    if(n >= 16)
+    {
+        uint8_t pattern[16];
+        for(int k = 0; k < 16; k++)
+            pattern[k] = value[k % size];
+
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern));
+
+        for(; i + 16 <= n; i += 16)
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+    }
+#endif
+
+    for(; i < n; i++)
+        dst[i] = value[i % size];
+}
+
+/* rotated images are copied in square tiles of this many pixels a side */
+const int rotate_tile = 32;
+
+/*
+ * Copies [x0, x1) by [y0, y1) of dst from src turned 90 degrees clockwise with
+ * its top left corner at [px, py] after amount pixels of extruded edge. A row
+ * of dst is a column of src read bottom to top, so only a tile's worth of src
+ * rows is touched at a time.
+ */
+template<int Size>
+void rotateTile(PixelData &dst, const PixelData &src, int px, int py, int amount, int x0, int y0, int x1, int y1)
+{
+    int w = src.width(), h = src.height();
+
+    for(int y = y0; y < y1; y++)
+    {
+        int sx = std::min(std::max(y - py - amount, 0), w - 1);
+        uint8_t *d = dst.row(y) + x0 * Size;
+
+        for(int x = x0; x < x1; x++, d += Size)
+        {
+            int sy = h - 1 - std::min(std::max(x - px - amount, 0), h - 1);
+            std::memcpy(d, src.row(sy) + sx * Size, Size);
+        }
+    }
+}
 
 } /* end unnamed namespace */
 
 
+/*--------------------------------------------------------------------------*
+ *
+ * Hashing
+ *
+ *--------------------------------------------------------------------------*/
+
+/*
+ * MurmurHash64A. Reads 8 bytes per step which is many times faster than a
+ * byte wise crc on large pixel buffers.
+ */
+uint64_t Imagepack::hashBytes(const void *data, size_t size, uint64_t seed)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    const unsigned char *end   = bytes + (size & ~static_cast<size_t>(7));
+    uint64_t h = seed ^ (size * m);
+
+    for(; bytes != end; bytes += 8)
+    {
+        uint64_t k;
+        std::memcpy(&k, bytes, sizeof(k));
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    if(size & 7)
+    {
+        for(size_t i = 0, n = size & 7; i < n; i++)
+            h ^= static_cast<uint64_t>(bytes[i]) << (i*8);
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
+    return h;
+}
+
+
+
 /*--------------------------------------------------------------------------*
  *
  * PixelFloat
@@ -87,9 +586,169 @@ bool Pixel32::operator!=(const Pixel32 &o) const { return !(*this == o); }
  *
  *--------------------------------------------------------------------------*/
 
-void PixelData::resize(int width, int height)
+PixelData::PixelData()
+{
+    arena = NULL;
+    block = data = NULL;
+    block_size = 0;
+    data_format = RGBA8;
+    data_width = data_height = 0;
+    data_stride = 0;
+}
+
+/* copies are allocated from the heap whatever o was allocated from */
+PixelData::PixelData(const PixelData &o)
+{
+    arena = NULL;
+    block = data = NULL;
+    block_size = 0;
+    data_format = RGBA8;
+    data_width = data_height = 0;
+    data_stride = 0;
+    *this = o;
+}
+
+PixelData::~PixelData()
+{
+    releaseBlock();
+}
+
+/*
+ * Copies always own their pixels, even when copying a view.
+ */
+PixelData& PixelData::operator=(const PixelData &o)
+{
+    if(this != &o)
+    {
+        resize(o.width(), o.height(), o.format());
+        blit(0, 0, o);
+    }
+    return *this;
+}
+
+/*
+ * Drops any pixels and allocates from arena from now on. NULL allocates from
+ * the heap.
+ */
+void PixelData::setArena(PixelArena *arena)
+{
+    resize(0, 0);
+    this->arena = arena;
+}
+
+/*
+ * Every pixel is 0 after resizing. The block is kept if it is already the
+ * right size and resizing to 0x0 releases it.
+ */
+void PixelData::resize(int width, int height, int format)
+{
+    data_format = format;
+    data_width  = std::max(width,  0);
+    data_height = std::max(height, 0);
+    data_stride = static_cast<size_t>(data_width) * Imagepack::pixelSize(format);
+
+    size_t size = data_stride * data_height;
+
+    if(size != block_size)
+    {
+        releaseBlock();
+        allocateBlock(size);
+    }
+
+    if(block)
+        std::memset(block, 0, size);
+    data = block;
+}
+
+void PixelData::view(const void *pixels, int width, int height, size_t stride, int format)
+{
+    releaseBlock();
+
+    data        = static_cast<uint8_t*>(const_cast<void*>(pixels));
+    data_format = format;
+    data_width  = width;
+    data_height = height;
+    data_stride = stride;
+}
+
+/*
+ * Converts the pixels to another format in place. Converting to a narrower
+ * format loses anything the narrower format can't hold.
+ */
+void PixelData::convert(int format)
 {
-    pixels.resize(boost::extents[std::max(width, 0)][std::max(height, 0)]);
+    if(format == data_format)
+        return;
+
+    PixelData converted;
+    converted.setArena(arena);
+    converted.resize(width(), height(), format);
+    converted.blit(0, 0, *this);
+
+    swapBlock(converted);
+    data        = block;
+    data_format = format;
+    data_stride = converted.data_stride;
+}
+
+/*
+ * The narrowest format that holds every pixel exactly.
+ */
+int PixelData::narrowestFormat() const
+{
+    int narrowest = GRAY8;
+
+    for(int y = 0; y < height() && narrowest != data_format; y++)
+        narrowest = widerFormat(narrowest, Imagepack::narrowestFormat(row(y), data_format, width()));
+
+    return height() > 0 ? narrowest : data_format;
+}
+
+/*
+ * Finds the smallest rectangle holding every pixel with a non zero alpha.
+ * Returns false if every pixel is transparent.
+ */
+bool PixelData::opaqueBounds(int &x, int &y, int &w, int &h) const
+{
+    int x0 = width(), x1 = -1, y0 = height(), y1 = -1;
+
+    for(int row_y = 0; row_y < height(); row_y++)
+    {
+        int first, last;
+        if(!findOpaque(row(row_y), data_format, width(), first, last))
+            continue;
+
+        x0 = std::min(x0, first);
+        x1 = std::max(x1, last);
+        y0 = std::min(y0, row_y);
+        y1 = row_y;
+    }
+
+    if(y1 < 0)
+        return false;
+
+    x = x0;
+    y = y0;
+    w = x1 - x0 + 1;
+    h = y1 - y0 + 1;
+    return true;
+}
+
+/*
+ * Keeps only the w by h pixels with their top left corner at [x, y].
+ */
+void PixelData::crop(int x, int y, int w, int h)
+{
+    PixelData cropped;
+    cropped.setArena(arena);
+    cropped.resize(w, h, data_format);
+    cropped.blit(-x, -y, *this);
+
+    swapBlock(cropped);
+    data        = block;
+    data_width  = cropped.data_width;
+    data_height = cropped.data_height;
+    data_stride = cropped.data_stride;
 }
 
 void PixelData::set(int x, int y, float r, float g, float b, float a)
@@ -100,7 +759,7 @@ void PixelData::set(int x, int y, float r, float g, float b, float a)
 void PixelData::set(int x, int y, Pixel p)
 {
     if(0 <= x && x < width() && 0 <= y && y < height())
-        pixels[x][y] = p;
+        convertPixels(reinterpret_cast<const uint8_t*>(&p), RGBA8, row(y) + x * pixelSize(), data_format, 1);
 }
 
 void PixelData::fill(float r, float g, float b, float a)
@@ -110,6 +769,9 @@ void PixelData::fill(float r, float g, float b, float a)
 
 void PixelData::fillRect(int x0, int y0, int x1, int y1, Pixel p)
 {
+    if(width() == 0 || height() == 0)
+        return;
+
     if(x0 > x1) std::swap(x0, x1);
     if(y0 > y1) std::swap(y0, y1);
 
@@ -118,54 +780,213 @@ void PixelData::fillRect(int x0, int y0, int x1, int y1, Pixel p)
     y0 = std::min(std::max(0, y0), height()-1);
     y1 = std::min(std::max(0, y1), height()-1);
 
-    for(int x = x0; x <= x1; x++)
-        for(int y = y0; y <= y1; y++)
-            pixels[x][y] = p;
+    uint8_t value[8];
+    convertPixels(reinterpret_cast<const uint8_t*>(&p), RGBA8, value, data_format, 1);
+
+    for(int y = y0; y <= y1; y++)
+        fillPixels(row(y) + x0 * pixelSize(), value, pixelSize(), x1 - x0 + 1);
 }
 
+/*
+ * Pixels of another format are converted as they are copied.
+ */
 void PixelData::blit(int px, int py, const PixelData &data)
 {
     int x0 = std::max(0, px);
     int y0 = std::max(0, py);
 
-    int x1 = std::min(width(),  x0 + data.width());
-    int y1 = std::min(height(), y0 + data.height());
+    int x1 = std::min(width(),  px + data.width());
+    int y1 = std::min(height(), py + data.height());
+
+    if(x0 >= x1)
+        return;
+
+    for(int y = y0; y < y1; y++)
+        convertPixels(data.row(y - py) + (x0 - px) * data.pixelSize(), data.format(), row(y) + x0 * pixelSize(), data_format, x1 - x0);
+}
+
+/*
+ * Draws data with its top left corner at [px + amount, py + amount] and its
+ * edge pixels replicated outwards by amount pixels, clipped to this pixel
+ * data. Each row is built straight from the nearest source row so the border
+ * never has to be stored with the image or composed in a separate pass.
+ * Source rows of another format are converted once before being copied.
+ */
+void PixelData::blitExtruded(int px, int py, const PixelData &data, int amount)
+{
+    int w = data.width(), h = data.height();
+    int size = pixelSize();
+    amount = std::max(0, amount);
+
+    if(w <= 0 || h <= 0)
+        return;
+
+    int x0 = std::max(0, px);
+    int y0 = std::max(0, py);
+    int x1 = std::min(width(),  px + w + amount*2);
+    int y1 = std::min(height(), py + h + amount*2);
+
+    if(x0 >= x1)
+        return;
+
+    /* left border, source and right border columns clipped to [x0, x1) */
+    int left_end    = std::min(x1, px + amount);
+    int src_begin   = std::max(x0, px + amount);
+    int src_end     = std::min(x1, px + amount + w);
+    int right_begin = std::max(x0, px + amount + w);
+
+    std::vector<uint8_t> converted;
+    if(data.format() != data_format)
+        converted.resize(static_cast<size_t>(w) * size);
+
+    for(int y = y0; y < y1; y++)
+    {
+        const uint8_t *src = data.row(std::min(std::max(y - py - amount, 0), h - 1));
+        uint8_t *dst = row(y);
+
+        if(!converted.empty())
+        {
+            convertPixels(src, data.format(), &converted[0], data_format, w);
+            src = &converted[0];
+        }
+
+        if(x0 < left_end)
+            fillPixels(dst + x0 * size, src, size, left_end - x0);
+
+        if(src_begin < src_end)
+            std::memcpy(dst + src_begin * size, src + (src_begin - px - amount) * size, static_cast<size_t>(src_end - src_begin) * size);
 
-    for(int x = x0; x < x1; x++)
-        for(int y = y0; y < y1; y++)
-            pixels[x][y] = data.pixels[x-x0][y-y0];
+        if(right_begin < x1)
+            fillPixels(dst + right_begin * size, src + (w - 1) * size, size, x1 - right_begin);
+    }
+}
+
+/*
+ * Like blitExtruded but with data turned 90 degrees clockwise, so it covers
+ * data.height() by data.width() pixels before extruding. Source column x
+ * becomes row x from the top and source row y becomes column height - 1 - y.
+ */
+void PixelData::blitRotatedExtruded(int px, int py, const PixelData &data, int amount)
+{
+    int w = data.width(), h = data.height();
+    amount = std::max(0, amount);
+
+    if(w <= 0 || h <= 0)
+        return;
+
+    int x0 = std::max(0, px);
+    int y0 = std::max(0, py);
+    int x1 = std::min(width(),  px + h + amount*2);
+    int y1 = std::min(height(), py + w + amount*2);
+
+    const PixelData *src = &data;
+    PixelData converted;
+
+    if(data.format() != data_format)
+    {
+        converted.resize(w, h, data_format);
+        for(int y = 0; y < h; y++)
+            convertPixels(data.row(y), data.format(), converted.row(y), data_format, w);
+        src = &converted;
+    }
+
+    for(int ty = y0; ty < y1; ty += rotate_tile)
+        for(int tx = x0; tx < x1; tx += rotate_tile)
+        {
+            int tx1 = std::min(tx + rotate_tile, x1);
+            int ty1 = std::min(ty + rotate_tile, y1);
+
+            switch(pixelSize())
+            {
+                case 1: rotateTile<1>(*this, *src, px, py, amount, tx, ty, tx1, ty1); break;
+                case 2: rotateTile<2>(*this, *src, px, py, amount, tx, ty, tx1, ty1); break;
+                case 4: rotateTile<4>(*this, *src, px, py, amount, tx, ty, tx1, ty1); break;
+                default: rotateTile<8>(*this, *src, px, py, amount, tx, ty, tx1, ty1); break;
+            }
+        }
+}
+
+uint8_t* PixelData::row(int y)
+{
+    return data + y * data_stride;
+}
+
+const uint8_t* PixelData::row(int y) const
+{
+    return data + y * data_stride;
 }
 
 Pixel PixelData::get(int x, int y) const
 {
+    Pixel p;
     if(0 <= x && x < width() && 0 <= y && y < height())
-        return pixels[x][y];
-    return Pixel();
+        convertPixels(row(y) + x * pixelSize(), data_format, reinterpret_cast<uint8_t*>(&p), RGBA8, 1);
+    return p;
 }
 
-int PixelData::width()  const { return pixels.shape()[0]; }
-int PixelData::height() const { return pixels.shape()[1]; }
+int    PixelData::width()     const { return data_width;  }
+int    PixelData::height()    const { return data_height; }
+size_t PixelData::stride()    const { return data_stride; }
+int    PixelData::format()    const { return data_format; }
+int    PixelData::pixelSize() const { return Imagepack::pixelSize(data_format); }
+size_t PixelData::rowBytes()  const { return static_cast<size_t>(data_width) * pixelSize(); }
 
-uint32_t PixelData::computeChecksum() const
+uint64_t PixelData::computeChecksum() const
 {
-    boost::crc_32_type crc;
-    crc.process_bytes(pixels.data(), width()*height()*sizeof(Pixel));
-    return crc.checksum();
+    /*
+     * rows are hashed one at a time so the checksum doesn't depend on the
+     * stride. the size and format are part of the seed so a 2x1 and 1x2 image
+     * don't collide.
+     */
+    uint64_t h = (static_cast<uint64_t>(width()) << 32) | static_cast<uint32_t>(height());
+    h = hashBytes(&data_format, sizeof(data_format), h);
+
+    for(int y = 0; y < height(); y++)
+        h = hashBytes(row(y), rowBytes(), h);
+
+    return h;
 }
 
 bool PixelData::operator==(const PixelData &o) const
 {
-    if(width() != o.width() || height() != o.height())
+    if(width() != o.width() || height() != o.height() || format() != o.format())
         return false;
 
-    for(int x = 0, w = width(); x < w; x++)
-        for(int y = 0, h = height(); y < h; y++)
-            if(pixels[x][y] != o.pixels[x][y])
-                return false;
+    for(int y = 0, h = height(); y < h; y++)
+        if(std::memcmp(row(y), o.row(y), rowBytes()) != 0)
+            return false;
 
     return true;
 }
 
+void PixelData::allocateBlock(size_t size)
+{
+    if(size > 0)
+        block = arena ? static_cast<uint8_t*>(arena->allocate(size)) : new uint8_t[size];
+    block_size = size;
+}
+
+void PixelData::releaseBlock()
+{
+    if(block)
+    {
+        if(arena)
+            arena->release(block, block_size);
+        else
+            delete[] block;
+    }
+
+    block = data = NULL;
+    block_size = 0;
+}
+
+/* both must allocate from the same arena */
+void PixelData::swapBlock(PixelData &o)
+{
+    std::swap(block, o.block);
+    std::swap(block_size, o.block_size);
+}
+
 
 
 /*--------------------------------------------------------------------------*
@@ -192,81 +1013,139 @@ bool Image::loadData()
 
 
 
-bool Image::initialize(const std::string &name, int extrude)
+/* size of the area the image covers in its sheet */
+int Image::sheetWidth() const
+{
+    return rotated ? height : width;
+}
+
+int Image::sheetHeight() const
+{
+    return rotated ? width : height;
+}
+
+bool Image::initialize(const std::string &name, int extrude, bool trim)
+{
+    reset(name, extrude, trim);
+    return createImageData();
+}
+
+/*
+ * Sets up the image from the size in its file header without decoding any
+ * pixels. The checksum is not known so the image can be packed but not
+ * compared or drawn. Borders can't be trimmed without the pixels so the
+ * whole image is packed.
+ */
+bool Image::probe(const std::string &name, int extrude, bool trim)
+{
+    reset(name, extrude, trim);
+
+    if(!probeImage(names[0], source_width, source_height) || source_width <= 0 || source_height <= 0)
+        return false;
+
+    original_width  = source_width;
+    original_height = source_height;
+    source_x_offset = extrude;
+    source_y_offset = extrude;
+    width           = source_width  + extrude*2;
+    height          = source_height + extrude*2;
+
+    return true;
+}
+
+void Image::reset(const std::string &name, int extrude, bool trim)
 {
     names.assign(1, name);
     this->extrude = extrude;
+    this->trim    = trim;
 
     sheet_x = sheet_y = width = height = 0;
     source_x_offset = source_y_offset = source_width = source_height = 0;
+    trim_x = trim_y = original_width = original_height = 0;
     s0 = s1 = t0 = t1 = 0.0f;
-    checksum = 0xDEADC0DE;
+    checksum = 0xDEADC0DEDEADC0DEULL;
+    pixel_format = RGBA8;
+    spill = NULL;
+    spill_offset = 0;
     is_packed = false;
+    rotated = false;
     has_data = false;
-
-    return createImageData();
 }
 
+/*
+ * Only the source pixels are kept. Edges are extruded when the image is drawn
+ * in to a sheet. The cache holds untrimmed pixels so its entries are shared
+ * between runs with and without trimming.
+ */
 bool Image::createImageData()
 {
-    PixelData src_data;
+    bool cached = loadCachedImage(names[0], pixels, checksum);
 
-    if(!loadImage(names[0], src_data))
+    if(!cached && !loadImage(names[0], pixels))
         return false;
 
-    if(src_data.width() == 0 || src_data.height() == 0)
+    if(pixels.width() == 0 || pixels.height() == 0)
         return false;
 
-    source_x_offset = extrude;
-    source_y_offset = extrude;
-    source_width    = src_data.width();
-    source_height   = src_data.height();
-    width           = src_data.width()  + extrude*2;
-    height          = src_data.height() + extrude*2;
+    if(!cached)
+    {
+        checksum = pixels.computeChecksum();
+        storeCachedImage(names[0], pixels, checksum);
+    }
 
-    pixels.resize(width, height);
+    original_width  = pixels.width();
+    original_height = pixels.height();
+    trim_x = trim_y = 0;
 
-    if(extrude > 0)
-    {
-        int src_x0 = source_x_offset - 1;
-        int src_y0 = source_y_offset - 1;
-        int src_x1 = source_x_offset + source_width;
-        int src_y1 = source_y_offset + source_height;
+    if(trim)
+        trimPixels();
 
-        int dst_x0 = src_x0 - extrude + 1;
-        int dst_y0 = src_y0 - extrude + 1;
-        int dst_x1 = src_x1 + extrude - 1;
-        int dst_y1 = src_y1 + extrude - 1;
+    source_x_offset = extrude;
+    source_y_offset = extrude;
+    source_width    = pixels.width();
+    source_height   = pixels.height();
+    width           = source_width  + extrude*2;
+    height          = source_height + extrude*2;
+    pixel_format    = pixels.format();
+    has_data        = true;
 
-        pixels.fillRect(src_x0, src_y0, dst_x0, dst_y0, src_data.get(0,              0              ));
-        pixels.fillRect(src_x1, src_y0, dst_x1, dst_y0, src_data.get(source_width-1, 0              ));
-        pixels.fillRect(src_x1, src_y1, dst_x1, dst_y1, src_data.get(source_width-1, source_height-1));
-        pixels.fillRect(src_x0, src_y1, dst_x0, dst_y1, src_data.get(0,              source_height-1));
+    return true;
+}
 
-        for(int x = 0; x < source_width; x++)
-        {
-            pixels.fillRect(extrude+x, src_y0, extrude+x, dst_y0, src_data.get(x, 0              ));
-            pixels.fillRect(extrude+x, src_y1, extrude+x, dst_y1, src_data.get(x, source_height-1));
-        }
+/*
+ * Crops fully transparent rows and columns from the pixels. An image that is
+ * entirely transparent keeps its top left pixel. The offset and original size
+ * are part of the checksum since images are only merged when all of their
+ * definitions match.
+ */
+void Image::trimPixels()
+{
+    int x, y, w, h;
 
-        for(int y = 0; y < source_height; y++)
-        {
-            pixels.fillRect(src_x0, extrude+y, dst_x0, extrude+y, src_data.get(0,              y));
-            pixels.fillRect(src_x1, extrude+y, dst_x1, extrude+y, src_data.get(source_width-1, y));
-        }
+    if(!pixels.opaqueBounds(x, y, w, h))
+    {
+        x = y = 0;
+        w = h = 1;
+    }
+
+    if(w != pixels.width() || h != pixels.height())
+    {
+        pixels.crop(x, y, w, h);
+        pixels.convert(pixels.narrowestFormat());
+        checksum = pixels.computeChecksum();
     }
 
-    pixels.blit(extrude, extrude, src_data);
-    checksum = pixels.computeChecksum();
-    has_data = true;
+    trim_x = x;
+    trim_y = y;
 
-    return true;
+    int32_t rect[4] = {trim_x, trim_y, original_width, original_height};
+    checksum = hashBytes(rect, sizeof(rect), checksum);
 }
 
 bool Image::recreateImageData()
 {
     int prev_w = width, prev_h = height;
-    uint32_t prev_checksum = checksum;
+    uint64_t prev_checksum = checksum;
 
     /*
      * checksum should pick up any changes in the image between multiple reads
@@ -275,20 +1154,48 @@ bool Image::recreateImageData()
      * different image data will just produce incorrect output.
      */
     if(!createImageData() || prev_checksum != checksum || prev_w != width || prev_h != height)
-        return fatal(format("failed to reload '%s'. File changed or removed?\n"));
+    {
+        purgeMemory();
+        return false;
+    }
     return true;
 }
 
-const PixelData& Image::getPixels()
+/*
+ * Returns the pixel data, reading it again if it was purged. Returns NULL if
+ * the image can't be read again or has changed since it was added. Sheets are
+ * composed on worker threads so the caller decides how to report that.
+ */
+const PixelData* Image::getPixels()
 {
     if(!has_data)
-        recreateImageData();
-    return pixels;
+    {
+        if(spill)
+            has_data = spill->view(spill_offset, source_width, source_height, pixel_format, pixels);
+
+        if(!has_data && !recreateImageData())
+            return NULL;
+    }
+    return &pixels;
 }
 
 bool Image::equalPixelData(Image &other)
 {
-    return checksum == other.checksum && getPixels() == other.getPixels();
+    if(trim_x != other.trim_x || trim_y != other.trim_y || original_width != other.original_width || original_height != other.original_height)
+        return false;
+
+    if(checksum != other.checksum)
+        return false;
+
+    const PixelData *a = getPixels();
+    if(!a)
+        return fatal(reloadFailure(this));
+
+    const PixelData *b = other.getPixels();
+    if(!b)
+        return fatal(reloadFailure(&other));
+
+    return *a == *b;
 }
 
 void Image::purgeMemory()
@@ -297,114 +1204,227 @@ void Image::purgeMemory()
     has_data = false;
 }
 
-void Image::addName(const std::string &name) { names.push_back(name); }
+void Image::addName(const std::string &name) { names.push_back(name); }
+
+/*
+ * Writes the pixel data to file and drops it from memory. Later calls to
+ * getPixels read it back from the file instead of decoding the image again.
+ */
+void Image::spillTo(SpillFile *file)
+{
+    const PixelData *data = getPixels();
+    if(!data)
+        fatal(reloadFailure(this));
+
+    spill_offset = file->write(*data);
+    spill        = file;
+    purgeMemory();
+}
+
+
+/*--------------------------------------------------------------------------*
+ *
+ * sheet
+ *
+ *--------------------------------------------------------------------------*/
+
+Sheet::Sheet(int width, int height, int algorithm, bool allow_rotation)
+{
+    this->width     = width;
+    this->height    = height;
+    this->algorithm = algorithm;
+    extrude         = 0;
+    previous_index  = -1;
+    engine.reset(createPackEngine(algorithm, width, height, allow_rotation));
+}
+
+bool Sheet::insert(Image *img)
+{
+    if(!engine->insert(img->width, img->height, img->sheet_x, img->sheet_y, img->rotated))
+        return false;
+
+    images.push_back(img);
+    return true;
+}
+
+/*
+ * Places an image with its top left corner at [x, y], turned if rotated is
+ * set. Fails if any of the area is outside the sheet or already used, or the
+ * sheet's algorithm can't place images at fixed coordinates.
+ */
+bool Sheet::place(Image *img, int x, int y, bool rotated)
+{
+    if(!engine->place(x, y, rotated ? img->height : img->width, rotated ? img->width : img->height))
+        return false;
+
+    img->sheet_x = x;
+    img->sheet_y = y;
+    img->rotated = rotated;
+    images.push_back(img);
+
+    return true;
+}
+
+/*
+ * Identifies the sheet's contents so a previous run's output can be reused if
+ * nothing has changed. Independent of the order images were added in.
+ */
+uint64_t Sheet::signature() const
+{
+    std::vector<Image*> sorted(images.begin(), images.end());
+    std::sort(sorted.begin(), sorted.end(), imagePositionCompare);
 
+    int32_t size[3] = {width, height, extrude};
+    uint64_t h = hashBytes(size, sizeof(size));
 
-/*--------------------------------------------------------------------------*
- *
- * sheet
- *
- *--------------------------------------------------------------------------*/
+    for(size_t i = 0; i < sorted.size(); i++)
+    {
+        int32_t rect[4] = {sorted[i]->sheet_x, sorted[i]->sheet_y, sorted[i]->sheetWidth(), sorted[i]->sheetHeight()};
+        h = hashBytes(rect, sizeof(rect), h ^ sorted[i]->checksum);
+    }
 
-Sheet::Sheet(int width, int height)
-{
-    this->width  = width;
-    this->height = height;
-    extrude      = 0;
-    root         = createNode(0, 0, width, height);
+    return h;
 }
 
-bool Sheet::insert(Image *img)
+/*
+ * The narrowest format that holds every image. Space not covered by images is
+ * transparent so it needs an alpha channel unless the images cover the whole
+ * sheet.
+ */
+int Sheet::pixelFormat() const
 {
-    if(insertR(root, img))
+    int format = GRAY8;
+    long long covered = 0;
+
+    for(size_t i = 0; i < images.size(); i++)
     {
-        images.push_back(img);
-        return true;
+        format   = widerFormat(format, images[i]->pixel_format);
+        covered += static_cast<long long>(images[i]->width) * images[i]->height;
     }
 
-    return false;
+    if(covered < static_cast<long long>(width) * height)
+        format = widerFormat(format, GRAY_ALPHA8);
+
+    return format;
 }
 
-bool Sheet::insertR(Node *node, Image *img)
+/*
+ * Composes the sheet. Returns false if an image couldn't be read again. Runs
+ * on worker threads so failures are printed rather than fatal.
+ */
+bool Sheet::blit(PixelData &pixels)
 {
-    if(node->left && node->right)
-    {
-        return insertR(node->left, img) || insertR(node->right, img);
-    }
-    else
+    pixels.resize(width, height, pixelFormat());
+    pixels.fill(0.0f, 0.0f, 0.0f, 0.0f); //TODO fill colour
+
+    for(size_t i = 0; i < images.size(); i++)
     {
-        if(node->img || img->width > node->width || img->height > node->height)
-            return false;
+        Image *img = images[i];
+        bool purge = !img->has_data;
+        const PixelData *data = img->getPixels();
 
-        if(img->width == node->width && img->height == node->height)
+        if(!data)
         {
-            img->sheet_x = node->x;
-            img->sheet_y = node->y;
-            node->img = img;
-            return true;
+            print(reloadFailure(img));
+            return false;
         }
 
-        /* 
-         * calculate the remaining width and height in the node. the node is
-         * guaranted to be bigger than the image.
-         */
-        int rw = node->width  - img->width;
-        int rh = node->height - img->height;
-
-        if(rw > rh)
-        {
-            node->left  = createNode(node->x,            node->y, img->width, node->height);
-            node->right = createNode(node->x+img->width, node->y, rw,         node->height);
-        }
+        if(img->rotated)
+            pixels.blitRotatedExtruded(img->sheet_x, img->sheet_y, *data, img->extrude);
         else
-        {
-            node->left  = createNode(node->x, node->y,             node->width, img->height);
-            node->right = createNode(node->x, node->y+img->height, node->width, rh);
-        }
+            pixels.blitExtruded(img->sheet_x, img->sheet_y, *data, img->extrude);
 
-        return insertR(node->left, img);
+        if(purge)
+            img->purgeMemory();
     }
 
-    return false;
+    return true;
 }
 
-void Sheet::blit(PixelData &pixels)
+bool Sheet::saveImage(boost::filesystem::path &path)
 {
-    pixels.resize(width, height);
-    pixels.fill(0.0f, 0.0f, 0.0f, 0.0f); //TODO fill colour
-    blitR(root, pixels);
+    PixelData pixels;
+    return blit(pixels) && Imagepack::saveImage(path, pixels);
 }
 
-void Sheet::blitR(Node *node, PixelData &pixels)
+/*
+ * Composes the sheet band_height rows at a time and streams each band to the
+ * PNG writer so only a single band is held in memory. Images are blitted into
+ * every band they overlap and, when caching is disabled, only purged once the
+ * last band they cover has been written.
+ */
+bool Sheet::streamImage(const boost::filesystem::path &path, int band_height)
 {
-    if(!node) return;
-    
-    if(node->img)
+    band_height = std::max(1, std::min(band_height, height));
+
+    std::vector<Image*> pending(images.begin(), images.end());
+    std::stable_sort(pending.begin(), pending.end(), imageSheetYCompare);
+
+    std::vector<Image*> active;
+    std::vector<bool>   purge;
+    size_t next = 0;
+
+    int sheet_format = pixelFormat();
+
+    PngWriter writer;
+    if(!writer.open(path, width, height, sheet_format))
+        return false;
+
+    PixelData band;
+    band.resize(width, band_height, sheet_format);
+    bool ok = true;
+
+    for(int y0 = 0; y0 < height && ok; y0 += band_height)
     {
-        bool purge = !node->img->has_data;
-        pixels.blit(node->x, node->y, node->img->getPixels());
+        int rows = std::min(band_height, height - y0);
 
-        if(purge)
-            node->img->purgeMemory();
+        for(; next < pending.size() && pending[next]->sheet_y < y0 + rows; next++)
+        {
+            active.push_back(pending[next]);
+            purge.push_back(!pending[next]->has_data);
+        }
+
+        band.fill(0.0f, 0.0f, 0.0f, 0.0f);
+
+        for(size_t i = 0; i < active.size() && ok; )
+        {
+            Image *img = active[i];
+            const PixelData *data = img->getPixels();
+
+            if(!data)
+            {
+                print(reloadFailure(img));
+                ok = false;
+                break;
+            }
+
+            if(img->rotated)
+                band.blitRotatedExtruded(img->sheet_x, img->sheet_y - y0, *data, img->extrude);
+            else
+                band.blitExtruded(img->sheet_x, img->sheet_y - y0, *data, img->extrude);
+
+            if(img->sheet_y + img->sheetHeight() <= y0 + rows)
+            {
+                if(purge[i])
+                    img->purgeMemory();
+
+                active.erase(active.begin() + i);
+                purge.erase(purge.begin() + i);
+            }
+            else
+                i++;
+        }
+
+        if(ok)
+            ok = writer.writeRows(band, 0, rows);
     }
-    
-    blitR(node->left,  pixels);
-    blitR(node->right, pixels);
-}
 
-Node* Sheet::createNode(int x, int y, int w, int h)
-{
-    Node *n = node_pool.construct();
-    nodes.push_back(n);
-    n->img = NULL; n->x = x; n->y = y; n->width = w; n->height = h;
-    return n;
-}
+    /* images still active when a band failed are purged here instead */
+    for(size_t i = 0; i < active.size(); i++)
+        if(purge[i])
+            active[i]->purgeMemory();
 
-bool Sheet::saveImage(boost::filesystem::path &path)
-{
-    PixelData pixels;
-    blit(pixels);
-    return Imagepack::saveImage(path, pixels);
+    return ok && writer.close();
 }
 
 
@@ -415,15 +1435,114 @@ bool Sheet::saveImage(boost::filesystem::path &path)
  *
  *--------------------------------------------------------------------------*/
 
+/*
+ * Decodes images on background threads as they are queued. Images are handed
+ * back in the order they were queued so duplicates are resolved the same way
+ * as when adding images one at a time.
+ */
+class Imagepack::ImageLoader : private boost::noncopyable
+{
+private:
+    struct Pending
+    {
+        std::string name;
+        Image       *img;
+        bool        done;
+        bool        loaded;
+    };
+
+    boost::mutex                mutex;
+    boost::condition_variable   finished;
+    std::deque<Pending>         pending;
+    int                         extrude;
+    bool                        trim;
+    bool                        decode;
+
+    /* last so the workers are joined before anything they use is destroyed */
+    TaskQueue                   tasks;
+
+public:
+    ImageLoader(int extrude, bool trim, bool decode) : extrude(extrude), trim(trim), decode(decode), tasks(numJobs()) {}
+
+    /* only the thread queueing images changes the size */
+    size_t size() const { return pending.size(); }
+
+    void push(const std::string &name, Image *img)
+    {
+        Pending p = { name, img, false, false };
+        Pending *queued;
+
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            pending.push_back(p);
+            queued = &pending.back();
+        }
+
+        tasks.push(boost::bind(&ImageLoader::load, this, queued));
+    }
+
+    /*
+     * Takes the first image queued if it has finished loading, waiting for it
+     * if wait is true. Returns false if there is nothing to take.
+     */
+    bool pop(std::string &name, Image *&img, bool &loaded, bool wait)
+    {
+        boost::mutex::scoped_lock lock(mutex);
+
+        if(pending.empty())
+            return false;
+
+        while(!pending.front().done)
+        {
+            if(!wait)
+                return false;
+            finished.wait(lock);
+        }
+
+        name.swap(pending.front().name);
+        img    = pending.front().img;
+        loaded = pending.front().loaded;
+        pending.pop_front();
+
+        return true;
+    }
+
+private:
+    void load(Pending *p)
+    {
+        bool loaded = decode ? p->img->initialize(p->name, extrude, trim) : p->img->probe(p->name, extrude, trim);
+
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            p->loaded = loaded;
+            p->done   = true;
+        }
+
+        finished.notify_all();
+    }
+};
+
+
 Packer::Packer()
 {
     sheet_width = sheet_height = 1024;
     sheets.reserve(32);
     tex_coord_origin = BOTTOM_LEFT;
     extrude = 0;
+    algorithm = GUILLOTINE;
+    sort_order = SORT_WIDTH;
+    search = false;
+    allow_rotation = false;
+    trim = false;
     compact = false;
     power_of_two = false;
     cache_images = true;
+    decode_images = true;
+}
+
+/* defined here so scoped_ptr can see the complete SpillFile and ImageLoader */
+Packer::~Packer()
+{
 }
 
 void Packer::pack()
@@ -435,120 +1554,241 @@ void Packer::pack()
     for(size_t i = 0, n = images.size(); i < n; i++)
         images[i]->is_packed = false;
 
+    packPrevious();
+    size_t num_previous = sheets.size();
+
     std::vector<Image*> to_pack;
     to_pack.reserve(images.size());
 
+    for(size_t i = 0, n = images.size(); i < n; i++)
+        if(!images[i]->is_packed)
+            to_pack.push_back(images[i]);
+
+    /* the search's pick only applies to this call */
+    int pack_algorithm = algorithm;
+    int pack_order     = sort_order;
+
+    if(search)
+        searchPortfolio(to_pack, pack_algorithm, pack_order);
+
+    sortForPacking(to_pack, pack_order);
+
     int last_packed = 0;
 
     do
     {
-        Sheet *s = createSheet(sheet_width, sheet_height);
-
-        to_pack.clear();
-        for(size_t i = 0, n = images.size(); i < n; i++)
-            if(!images[i]->is_packed)
-                to_pack.push_back(images[i]);
+        Sheet *s = createSheet(sheet_width, sheet_height, pack_algorithm);
 
         last_packed = packSheet(to_pack, s);
 
         if(s->images.empty())
             destroySheet(s);
 
-    }while(last_packed > 0);
+    }while(last_packed > 0 && !to_pack.empty());
 
-    if(compact && !sheets.empty())
+    /* sheets kept from a previous run keep their size */
+    if(compact && sheets.size() > num_previous)
     {
         to_pack.assign(sheets.back()->images.begin(), sheets.back()->images.end());
         destroySheet(sheets.back());
-        packCompactSheet(to_pack, sheet_width, sheet_height);
+        packCompactSheet(to_pack, sheet_width, sheet_height, pack_algorithm);
     }
 
     computeTexCoords();
     printPackingStats();
 }
 
-int Packer::packSheet(std::vector<Image*> &to_pack, Sheet *s)
+/*
+ * Recreates the sheets of a previous run. Images that are unchanged in size are
+ * put back where they were and any other images are packed in to the space
+ * left before new sheets are created. Sheets left empty are removed.
+ */
+void Packer::packPrevious()
 {
-    int num_packed = 0;
+    if(previous_sheets.empty())
+        return;
 
-    std::stable_sort(to_pack.begin(), to_pack.end(), imageHeightCompare);
-    std::stable_sort(to_pack.begin(), to_pack.end(), imageWidthCompare);
+    /* images are put back at fixed coordinates which the guillotine tree can't describe */
+    int previous_algorithm = canPlace(algorithm) ? algorithm : MAXRECTS_BSSF;
 
-    for(size_t i = 0, n = to_pack.size(); i < n; i++)
+    for(size_t i = 0; i < previous_sheets.size(); i++)
+        createSheet(previous_sheets[i].first, previous_sheets[i].second, previous_algorithm)->previous_index = (int)i;
+
+    /*
+     * images are put back in the order of the previous definitions so an
+     * unchanged input writes identical definitions.
+     */
+    std::vector< std::pair<Placement, Image*> > kept;
+
+    for(size_t i = 0, n = images.size(); i < n; i++)
     {
-        if(s->insert(to_pack[i]))
+        Image *img = images[i];
+
+        for(size_t j = 0; j < img->names.size(); j++)
         {
-            to_pack[i]->is_packed = true;
-            num_packed++;
+            boost::unordered_map<std::string, Placement>::const_iterator it = previous_placements.find(img->names[j]);
+
+            if(it == previous_placements.end())
+                continue;
+
+            const Placement &p = it->second;
+
+            if(p.sheet >= 0 && p.sheet < (int)sheets.size() && p.width == img->source_width && p.height == img->source_height &&
+               (!p.rotated || allow_rotation))
+            {
+                kept.push_back(std::make_pair(p, img));
+                break;
+            }
         }
-        else
-            to_pack[i]->is_packed = false;
     }
 
-    return num_packed;
+    std::sort(kept.begin(), kept.end(), placementIndexCompare);
+    int num_kept = 0;
+
+    for(size_t i = 0; i < kept.size(); i++)
+    {
+        const Placement &p = kept[i].first;
+        Image *img = kept[i].second;
+
+        if(sheets[p.sheet]->place(img, p.x - img->source_x_offset, p.y - img->source_y_offset, p.rotated))
+        {
+            img->is_packed = true;
+            num_kept++;
+        }
+    }
+
+    std::vector<Image*> to_pack;
+
+    for(size_t i = 0, n = images.size(); i < n; i++)
+        if(!images[i]->is_packed)
+            to_pack.push_back(images[i]);
+
+    sortForPacking(to_pack, sort_order);
+
+    for(size_t i = 0; i < sheets.size(); i++)
+        packSheet(to_pack, sheets[i]);
+
+    /* later sheets move down but keep previous_index to be matched with their files */
+    for(size_t i = sheets.size(); i-- > 0; )
+        if(sheets[i]->images.empty())
+            destroySheet(sheets[i]);
+
+    print(format("kept %d images from %d previous sheets\n") % num_kept % previous_sheets.size());
 }
 
-void Packer::packCompactSheet(std::vector<Image*> &to_pack, int max_width, int max_height)
+/*
+ * Packs images from to_pack, which must already be sorted, in to the sheet and
+ * removes those packed from to_pack. The images left keep their order so the
+ * list can be passed on to the next sheet without sorting it again.
+ */
+int Packer::packSheet(std::vector<Image*> &to_pack, Sheet *s)
 {
-    int sizes[2]     = {1, 1};
-    int max_sizes[2] = {max_width, max_height};
-    int size_index   = 0;
-    int packed       = 0;
+    size_t num_left = 0;
 
-    /*
-     * Set the initial size to be large enough to hold the smallest sprite.
-     * This ensures that all sprices can be placed by increasing just width or
-     * height.
-     */
-    for(size_t i = 0; i < to_pack.size(); i++)
+    for(size_t i = 0, n = to_pack.size(); i < n; i++)
     {
-        sizes[0] = std::max(sizes[0], to_pack[i]->width);
-        sizes[1] = std::max(sizes[1], to_pack[i]->height);
+        Image *img = to_pack[i];
+        img->is_packed = s->insert(img);
+
+        if(!img->is_packed)
+            to_pack[num_left++] = img;
     }
 
-    do
+    int num_packed = static_cast<int>(to_pack.size() - num_left);
+    to_pack.resize(num_left);
+
+    return num_packed;
+}
+
+/*
+ * Tries every algorithm with every sort order and sets best_algorithm and
+ * best_order to the pair that packs the images on to the fewest sheets, then
+ * the smallest area. The configured algorithm sorted by width is tried first
+ * so it is kept unless another does better. The trials run in parallel.
+ */
+void Packer::searchPortfolio(const std::vector<Image*> &to_pack, int &best_algorithm, int &best_order)
+{
+    if(to_pack.empty())
+        return;
+
+    PortfolioSearch portfolio(sheet_width, sheet_height, allow_rotation);
+
+    for(int i = 0; i < NUM_SORT_ORDERS; i++)
     {
-        Sheet s(sizes[0], sizes[1]);
-        packed = packSheet(to_pack, &s);
+        portfolio.sorted[i] = to_pack;
+        sortForPacking(portfolio.sorted[i], i);
+    }
 
-        if(packed != 0)
-            size_index = (size_index + 1) % 2;
+    portfolio.addTrial(algorithm, SORT_WIDTH);
 
-        if(sizes[size_index] == max_sizes[size_index])
-            size_index = (size_index + 1) % 2;
+    for(int a = 0; a < NUM_PACK_ALGORITHMS; a++)
+        for(int i = 0; i < NUM_SORT_ORDERS; i++)
+            if(a != algorithm || i != SORT_WIDTH)
+                portfolio.addTrial(a, i);
 
-        if(packed != (int)to_pack.size())
-            sizes[size_index]++;
+    parallelFor(portfolio.trials.size(), boost::ref(portfolio));
 
-        /*
-         * this shouldn't happen when when max_width and max_height have been
-         * obtained from a previous sheet with the same packed images.
-         */
-        if(sizes[0] > max_sizes[0] && sizes[1] > max_sizes[1])
-        {
-            print("failed to fit all sprites in a compact sheet\n", VERBOSE);
-            break;
-        }
-    } while(packed != (int)to_pack.size());
+    const PortfolioSearch::Trial &best = portfolio.best();
+    best_algorithm = best.algorithm;
+    best_order     = best.order;
+
+    print(format("search picked %s sorted by %s: %d sheets\n") % packAlgorithmName(best_algorithm) % sort_order_names[best_order] % best.num_sheets, VERBOSE);
+}
+
+/*
+ * Repacks the images of the last sheet with algorithm into the smallest sheet
+ * they fit. Sizes are limited to powers of two when power_of_two is set. The
+ * images are in the order they were packed so they are already sorted.
+ */
+void Packer::packCompactSheet(std::vector<Image*> &to_pack, int max_width, int max_height, int algorithm)
+{
+    int min_width  = 1;
+    int min_height = 1;
 
     /*
-     * sizes can be > max_size if all images can't be packed into an image of
-     * max_size.
+     * the sheet has to be at least as big as the widest and tallest sprite,
+     * or as the shorter side of every sprite if they can be turned.
      */
-    sizes[0] = std::min(sizes[0], max_sizes[0]);
-    sizes[1] = std::min(sizes[1], max_sizes[1]);
+    for(size_t i = 0; i < to_pack.size(); i++)
+    {
+        int w = to_pack[i]->width;
+        int h = to_pack[i]->height;
+
+        if(allow_rotation)
+            w = h = std::min(w, h);
+
+        min_width  = std::max(min_width,  w);
+        min_height = std::max(min_height, h);
+    }
+
+    CompactSearch search(to_pack, algorithm, allow_rotation);
 
     if(power_of_two)
     {
-        sizes[0] = nextPowerOfTwo(sizes[0]);
-        sizes[1] = nextPowerOfTwo(sizes[1]);
+        for(int w = nextPowerOfTwo(min_width); w <= max_width; w *= 2)
+            search.widths.push_back(w);
+        for(int h = nextPowerOfTwo(min_height); h <= max_height; h *= 2)
+            search.heights.push_back(h);
+    }
+    else
+    {
+        for(int w = min_width; w <= max_width; w++)
+            search.widths.push_back(w);
+        for(int h = min_height; h <= max_height; h++)
+            search.heights.push_back(h);
     }
 
+    int width  = max_width;
+    int height = max_height;
+
     /*
-     * The minimum sheet size to fit all images is known so calling pack sheet
-     * will pack every image successfully.
+     * this shouldn't happen when when max_width and max_height have been
+     * obtained from a previous sheet with the same packed images.
      */
-    packSheet(to_pack, createSheet(sizes[0], sizes[1]));
+    if(search.heights.empty() || !search.run(width, height))
+        print("failed to fit all sprites in a compact sheet\n", VERBOSE);
+
+    packSheet(to_pack, createSheet(width, height, algorithm));
 }
 
 void Packer::computeTexCoords()
@@ -559,8 +1799,8 @@ void Packer::computeTexCoords()
             Image *img = sheets[i]->images[j];
             int x = img->sheet_x + img->source_x_offset;
             int y = img->sheet_y + img->source_y_offset;
-            int w = img->source_width;
-            int h = img->source_height;
+            int w = img->rotated ? img->source_height : img->source_width;
+            int h = img->rotated ? img->source_width  : img->source_height;
 
             if(tex_coord_origin == BOTTOM_LEFT)
                 y = sheets[i]->height - y - h;
@@ -583,52 +1823,153 @@ void Packer::printPackingStats()
         }
 
     print(format("packed %d/%d images into %d sheets\n") % (images.size() - unpacked) % images.size() % sheets.size());
+    print(format("pixel memory: %d KB used, %d KB reserved\n") % (pixel_arena.usedBytes() / 1024) % (pixel_arena.reservedBytes() / 1024), VERBOSE);
 }
 
 void Packer::addImage(const std::string &name)
+{
+    queueImage(name);
+    finishImages();
+}
+
+void Packer::addImages(const std::vector<std::string> &names)
+{
+    for(size_t i = 0; i < names.size(); i++)
+        queueImage(names[i]);
+
+    finishImages();
+}
+
+/*
+ * Starts decoding an image in the background. Decoded images are inserted in
+ * the order they were queued by later calls and by finishImages, which must
+ * be called before packing.
+ */
+void Packer::queueImage(const std::string &name)
 {
     print(format("adding %s\n") % name, VERBOSE);
 
-    for(size_t i = 0, n = images.size(); i < n; i++)
-        if(std::find(images[i]->names.begin(), images[i]->names.end(), name) != images[i]->names.end())
-        {
-            print(format("image '%s' already added\n") % name);
-            return;
-        }
+    if(!image_names.insert(name).second)
+    {
+        print(format("image '%s' already added\n") % name);
+        return;
+    }
+
+    if(!loader)
+        loader.reset(new ImageLoader(extrude, trim, decode_images));
+
+    /*
+     * limits how many decoded images are held before being inserted, which
+     * matters when caching is disabled.
+     */
+    size_t max_pending = numJobs() * 32;
+
+    while(insertLoadedImage(loader->size() >= max_pending))
+        ;
 
     Image *img = image_pool.construct();
+    img->pixels.setArena(&pixel_arena);
+
+    loader->push(name, img);
+}
+
+void Packer::finishImages()
+{
+    if(!loader)
+        return;
+
+    while(insertLoadedImage(true))
+        ;
+
+    loader.reset();
+}
 
-    if(!img->initialize(name, extrude))
+/*
+ * Inserts the next queued image if it has been decoded, waiting for it if
+ * wait is true. Returns false if no image was taken.
+ */
+bool Packer::insertLoadedImage(bool wait)
+{
+    std::string name;
+    Image *img;
+    bool loaded;
+
+    if(!loader->pop(name, img, loaded, wait))
+        return false;
+
+    if(loaded)
+        insertImage(img);
+    else
     {
+        image_names.erase(name);
         image_pool.destroy(img);
-        return;
     }
 
+    return true;
+}
+
+void Packer::insertImage(Image *img)
+{
+    /*
+     * Only images with the same checksum can hold the same pixel data so the
+     * full comparison, which may reload both images, is only made on a hash
+     * match.
+     */
     Image *duplicate_of = NULL;
-    for(size_t i = 0, n = images.size(); i < n && !duplicate_of; i++)
+    std::pair<image_index_t::iterator, image_index_t::iterator> range = image_index.equal_range(img->checksum);
+
+    /* probed images have no checksum to compare */
+    if(!decode_images)
+        range.first = range.second;
+
+    for(image_index_t::iterator it = range.first; it != range.second && !duplicate_of; ++it)
     {
-        if(img->equalPixelData(*images[i]))
-            duplicate_of = images[i];
+        if(img->equalPixelData(*it->second))
+            duplicate_of = it->second;
 
         if(!cache_images)
-            images[i]->purgeMemory();
+            it->second->purgeMemory();
     }
 
     if(duplicate_of)
     {
-        print(format("duplicate image data ['%s' == '%s']\n") % name % duplicate_of->names[0], VERBOSE);
-        duplicate_of->addName(name);
+        print(format("duplicate image data ['%s' == '%s']\n") % img->names[0] % duplicate_of->names[0], VERBOSE);
+        duplicate_of->addName(img->names[0]);
         image_pool.destroy(img);
     }
     else
     {
-        if(!cache_images)
+        if(spill)
+            img->spillTo(spill.get());
+        else if(!cache_images)
             img->purgeMemory();
 
         images.push_back(img);
+        image_index.insert(std::make_pair(img->checksum, img));
     }
 }
 
+void Packer::printOccupancy()
+{
+    long long total_used = 0, total_area = 0;
+
+    for(size_t i = 0, n = sheets.size(); i < n; i++)
+    {
+        long long used = 0, area = static_cast<long long>(sheets[i]->width) * sheets[i]->height;
+
+        for(size_t j = 0, m = sheets[i]->images.size(); j < m; j++)
+            used += static_cast<long long>(sheets[i]->images[j]->width) * sheets[i]->images[j]->height;
+
+        print(format("sheet %d: %dx%d, %d images, %.1f%% occupied\n") % i % sheets[i]->width % sheets[i]->height % sheets[i]->images.size() % (100.0 * used / area));
+
+        total_used += used;
+        total_area += area;
+    }
+
+    if(total_area > 0)
+        print(format("%d sheets, %.1f%% occupied\n") % sheets.size() % (100.0 * total_used / total_area));
+}
+
 int Packer::numImages()
 {
     return images.size();
@@ -669,6 +2010,67 @@ void Packer::setExtrude(int extrude)
     this->extrude = std::max(0, extrude);
 }
 
+void Packer::setTrim(bool value)
+{
+    trim = value;
+}
+
+void Packer::setAlgorithm(int algorithm)
+{
+    if(0 <= algorithm && algorithm < NUM_PACK_ALGORITHMS)
+        this->algorithm = algorithm;
+}
+
+void Packer::setSearch(bool value)
+{
+    search = value;
+}
+
+void Packer::setRotation(bool allow)
+{
+    allow_rotation = allow;
+}
+
+void Packer::setDecodeImages(bool decode)
+{
+    decode_images = decode;
+}
+
+/*
+ * Spilling writes each unique image to a memory mapped temporary file once it
+ * has been decoded. Caching is disabled and images are read back from the
+ * file rather than decoded again. If the file can't be created images are
+ * decoded again instead, as with caching off, so memory use stays bounded.
+ * Must be set before any images are added.
+ */
+void Packer::setSpill(bool value)
+{
+    if(value && !spill)
+    {
+        spill.reset(new SpillFile);
+        if(!spill->open())
+        {
+            print("images will be decoded again rather than spilled\n");
+            spill.reset();
+        }
+    }
+    else if(!value)
+        spill.reset();
+
+    if(value)
+        setCaching(false);
+}
+
+void Packer::addPreviousSheet(int width, int height)
+{
+    previous_sheets.push_back(std::make_pair(width, height));
+}
+
+void Packer::addPreviousPlacement(const std::string &name, const Placement &p)
+{
+    previous_placements[name] = p;
+}
+
 void Packer::setCaching(bool cache)
 {
     cache_images = cache;
@@ -692,9 +2094,25 @@ Sheet* Packer::getSheet(int index)
     return NULL;
 }
 
-Sheet* Packer::createSheet(int width, int height)
+Sheet* Packer::createSheet(int width, int height, int algorithm)
 {
-    Sheet *s   = sheet_pool.construct(width, height);
+    /* object_pool::construct only forwards three arguments */
+    void *mem = sheet_pool.malloc();
+    if(!mem)
+        throw std::bad_alloc();
+
+    Sheet *s;
+
+    try
+    {
+        s = new (mem) Sheet(width, height, algorithm, allow_rotation);
+    }
+    catch(...)
+    {
+        sheet_pool.free(static_cast<Sheet*>(mem));
+        throw;
+    }
+
     s->extrude = extrude;
     sheets.push_back(s);
 
@@ -721,6 +2139,8 @@ void Packer::clearImages()
     for(size_t i = 0, n = images.size(); i < n; i++)
         image_pool.destroy(images[i]);
     images.clear();
+    image_names.clear();
+    image_index.clear();
 }
 
 unsigned int Packer::nextPowerOfTwo(unsigned int n) const
@@ -5,20 +5,48 @@
 #include <string>
 #include <boost/filesystem.hpp>
 #include <boost/pool/object_pool.hpp>
-#include <boost/multi_array.hpp>
 #include <boost/format.hpp>
 #include <boost/cstdint.hpp>
 #include <boost/utility.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/scoped_ptr.hpp>
+#include "pixel_format.h"
+#include "pixel_arena.h"
+#include "pack_engine.h"
 
 namespace Imagepack
 {
 
+class SpillFile;
+class ImageLoader;
+
 enum
 {
     BOTTOM_LEFT,
     TOP_LEFT
 };
 
+/* orders images are packed in, biggest first by the named measure */
+enum
+{
+    SORT_WIDTH,
+    SORT_HEIGHT,
+    SORT_AREA,
+    SORT_MAX_SIDE,
+    SORT_PERIMETER,
+
+    NUM_SORT_ORDERS
+};
+
+/*--------------------------------------------------------------------------*
+ * Hashing
+ *--------------------------------------------------------------------------*/
+
+/* fast non-cryptographic 64 bit hash */
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed=0);
+
+
 /*--------------------------------------------------------------------------*
  * Pixel
  *--------------------------------------------------------------------------*/
@@ -63,10 +91,8 @@ public:
 };
 
 /*
- * Set the pixel type to use.
- *
- * Since only 32 bit imges are read at the moment there's no point using
- * floating point pixels.  Using 32bit saves x4 memory and is a bit faster
+ * Pixel used to pass single colours around. Pixel data itself is stored in
+ * the narrowest PixelFormat that holds it.
  */
 typedef Pixel32 Pixel;
 
@@ -74,27 +100,68 @@ typedef Pixel32 Pixel;
 /*--------------------------------------------------------------------------*
  * PixelData
  *--------------------------------------------------------------------------*/
-typedef boost::multi_array<Pixel, 2> pixel_array_t;
 
+/*
+ * Pixels are stored row major in one of the PixelFormats. Each row starts
+ * stride() bytes after the previous one so a row can be read or written as a
+ * single block.
+ *
+ * The pixels are either owned or a view of memory owned by something else,
+ * such as a memory mapped file. Views must not be written to. Owned pixels
+ * are allocated from the arena given to setArena, or the heap without one.
+ */
 class PixelData
 {
 private:
-    pixel_array_t   pixels;
+    PixelArena              *arena;
+    uint8_t                 *block;
+    size_t                  block_size;
+    uint8_t                 *data;
+    int                     data_format;
+    int                     data_width;
+    int                     data_height;
+    size_t                  data_stride;
 
 public:
-    void            resize(int width, int height);
+                    PixelData();
+                    PixelData(const PixelData &o);
+                    ~PixelData();
+    PixelData&      operator=(const PixelData &o);
+
+    void            setArena(PixelArena *arena);
+    void            resize(int width, int height, int format=RGBA8);
+    void            view(const void *pixels, int width, int height, size_t stride, int format);
+    void            convert(int format);
+    int             narrowestFormat() const;
+    bool            opaqueBounds(int &x, int &y, int &w, int &h) const;
+    void            crop(int x, int y, int w, int h);
     void            set(int x, int y, float r, float g, float b, float a=1.0f);
     void            set(int x, int y, Pixel p);
     void            fill(float r, float g, float b, float a);
     void            fillRect(int x0, int y0, int x1, int y1, Pixel p);
     void            blit(int px, int py, const PixelData &data);
+    void            blitExtruded(int px, int py, const PixelData &data, int amount);
+    void            blitRotatedExtruded(int px, int py, const PixelData &data, int amount);
+
+    /* first byte of row y. y is not bounds checked */
+    uint8_t*        row(int y);
+    const uint8_t*  row(int y) const;
 
     Pixel           get(int x, int y) const;
     int             width() const;
     int             height() const;
-    uint32_t        computeChecksum() const;
+    size_t          stride() const;
+    int             format() const;
+    int             pixelSize() const;
+    size_t          rowBytes() const;
+    uint64_t        computeChecksum() const;
 
     bool operator==(const PixelData &o) const;
+
+private:
+    void            allocateBlock(size_t size);
+    void            releaseBlock();
+    void            swapBlock(PixelData &o);
 };
 
 
@@ -160,53 +227,87 @@ public:
     /* size of the source image */
     int source_width, source_height;
 
+    /* offset of the source image in the file's image after trimming */
+    int trim_x, trim_y;
+
+    /* size of the image in the file before trimming */
+    int original_width, original_height;
+
     /* normalized texture coordinates */
     float s0, s1, t0, t1;
 
     /* number of pixels to extrude each edge by */
     int extrude;
 
+    /* true to crop fully transparent rows and columns from the source image */
+    bool trim;
+
     /* true if the image was packed. used during packing */
     bool is_packed;
 
+    /*
+     * true if the image is turned 90 degrees clockwise in its sheet, where it
+     * covers height by width pixels
+     */
+    bool rotated;
+
     /* true if pixel data is currently loaded */
     bool has_data;
 
     /* names of all images that refer to the pixel data */
     std::vector<std::string> names;
 
-    /* modified pixel data including borders */
+    /* source pixel data. borders are added when drawn in to a sheet */
     PixelData pixels;
 
-    /* pixel data checksum for equality and recreating image data */
-    uint32_t checksum;
+    /* PixelFormat of the source pixel data */
+    int pixel_format;
+
+    /* source pixel data checksum for equality and recreating image data */
+    uint64_t checksum;
+
+    /* file the pixel data was written to when spilling, or NULL */
+    SpillFile *spill;
+
+    /* offset of the pixel data in spill */
+    uint64_t spill_offset;
 
 
 public:
-    bool                initialize(const std::string &name, int extrude);
-    const PixelData&    getPixels();
+    bool                initialize(const std::string &name, int extrude, bool trim);
+    bool                probe(const std::string &name, int extrude, bool trim);
+    int                 sheetWidth() const;
+    int                 sheetHeight() const;
+    const PixelData*    getPixels();
     bool                equalPixelData(Image &other);
     void                purgeMemory();
     void                addName(const std::string &name);
+    void                spillTo(SpillFile *file);
 
 private:
+    void                reset(const std::string &name, int extrude, bool trim);
     bool                createImageData();
+    void                trimPixels();
     bool                recreateImageData();
 };
 
 /*--------------------------------------------------------------------------*
- * Node
+ * Placement
  *--------------------------------------------------------------------------*/
-struct Node
+
+/*
+ * Where a sprite was packed by a previous run. x and y are the coordinates of
+ * the source image in the sheet, as written to the definitions file.
+ */
+struct Placement
 {
-    Node *left, *right;
-    Image *img;
-   
-    /* coordinates of the node relative to the root */
+    int sheet;
     int x, y;
-
-    /* node's dimensions */
     int width, height;
+    bool rotated;
+
+    /* position of the entry in the previous definitions */
+    int index;
 };
 
 
@@ -216,22 +317,29 @@ struct Node
 class Sheet : private boost::noncopyable
 {
 public:
-    boost::object_pool<Node> node_pool;
     std::vector<Image*> images;
-    std::vector<Node*> nodes;
     int width, height;
     int extrude;
-    Node *root;
+
+    /* packing algorithm used to find space for images */
+    int algorithm;
+
+    /* index of the sheet in the previous output, or -1 for a new sheet */
+    int previous_index;
+
+private:
+    boost::scoped_ptr<PackEngine> engine;
 
 public:
-    Sheet(int width, int height);
+    Sheet(int width, int height, int algorithm, bool allow_rotation=false);
 
     bool insert(Image *img);
-    bool insertR(Node *node, Image *img);
-    void blit(PixelData &pixels);
-    void blitR(Node *node, PixelData &pixels);
-    Node* createNode(int x, int y, int w, int h);
+    bool place(Image *img, int x, int y, bool rotated=false);
+    uint64_t signature() const;
+    int pixelFormat() const;
+    bool blit(PixelData &pixels);
     bool saveImage(boost::filesystem::path &path);
+    bool streamImage(const boost::filesystem::path &path, int band_height);
 };
 
 
@@ -242,46 +350,90 @@ public:
 class Packer
 {
 private:
+    typedef boost::unordered_multimap<uint64_t, Image*> image_index_t;
+
+    /* pixels of every image. declared first so it outlives the images */
+    PixelArena                  pixel_arena;
+
     boost::object_pool<Image>   image_pool;
-    boost::object_pool<Node>    node_pool;
     boost::object_pool<Sheet>   sheet_pool;
 
     std::vector<Image*>         images;
-    std::vector<Node*>          nodes;
     std::vector<Sheet*>         sheets;
+
+    /* every name added so far, including those of duplicates */
+    boost::unordered_set<std::string> image_names;
+
+    /* unique images by pixel data checksum */
+    image_index_t               image_index;
+
     int                         sheet_width;
     int                         sheet_height;
     int                         tex_coord_origin;
     int                         extrude;
+    int                         algorithm;
+    int                         sort_order;
+    bool                        search;
+    bool                        allow_rotation;
+    bool                        trim;
     bool                        compact;
     bool                        power_of_two;
     bool                        cache_images;
+    bool                        decode_images;
+
+    /* sheet sizes and sprite placements from a previous run to keep */
+    std::vector<std::pair<int, int> > previous_sheets;
+    boost::unordered_map<std::string, Placement> previous_placements;
+
+    /* decoded images are written here when spilling is enabled */
+    boost::scoped_ptr<SpillFile> spill;
+
+    /* decodes queued images in the background until finishImages */
+    boost::scoped_ptr<ImageLoader> loader;
 
 public:
                                 Packer();
+                                ~Packer();
 
     void                        pack();
     void                        addImage(const std::string &name);
+    void                        addImages(const std::vector<std::string> &names);
+    void                        queueImage(const std::string &name);
+    void                        finishImages();
     int                         numImages();
     void                        setSheetSize(int width, int height);
     void                        setPowerOfTwo(bool value);
     void                        setCompact(bool value);
     void                        setTexCoordOrigin(int origin);
     void                        setExtrude(int extrude);
+    void                        setTrim(bool value);
+    void                        setAlgorithm(int algorithm);
+    void                        setSearch(bool value);
+    void                        setRotation(bool allow);
     void                        setCaching(bool cache);
+    void                        setDecodeImages(bool decode);
+    void                        setSpill(bool value);
+    void                        addPreviousSheet(int width, int height);
+    void                        addPreviousPlacement(const std::string &name, const Placement &p);
     int                         numSheets();
     Sheet*                      getSheet(int index);
+    void                        printOccupancy();
 
 private:
+    bool                        insertLoadedImage(bool wait);
+    void                        insertImage(Image *img);
+
+    void                        packPrevious();
+    void                        searchPortfolio(const std::vector<Image*> &to_pack, int &best_algorithm, int &best_order);
     int                         packSheet(std::vector<Image*> &to_pack, Sheet *s);
-    void                        packCompactSheet(std::vector<Image*> &to_pack, int max_width, int max_height);
+    void                        packCompactSheet(std::vector<Image*> &to_pack, int max_width, int max_height, int algorithm);
     
     void                        blitSheets();
 
     void                        computeTexCoords();
     void                        printPackingStats();
 
-    Sheet*                      createSheet(int width, int height);
+    Sheet*                      createSheet(int width, int height, int algorithm);
     void                        destroySheet(Sheet *s);
     void                        clearSheets();
     void                        clearImages();
@@ -0,0 +1,858 @@
+#include <stdint.h>
+#include <algorithm>
+#include <set>
+#include <vector>
+#include <boost/pool/object_pool.hpp>
+#include <boost/utility.hpp>
+#include "pack_engine.h"
+
+using namespace Imagepack;
+
+
+namespace {
+
+bool rectContains(const Rect &a, const Rect &b)
+{
+    return b.x >= a.x && b.y >= a.y && b.x + b.width <= a.x + a.width && b.y + b.height <= a.y + a.height;
+}
+
+bool rectIntersects(const Rect &a, const Rect &b)
+{
+    return a.x < b.x + b.width && b.x < a.x + a.width && a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+Rect makeRect(int x, int y, int w, int h)
+{
+    Rect r = {x, y, w, h};
+    return r;
+}
+
+const char *algorithm_names[NUM_PACK_ALGORITHMS] =
+{
+    "guillotine",
+    "guillotine-shorter",
+    "guillotine-max-area",
+    "guillotine-min-area",
+    "maxrects-bssf",
+    "maxrects-baf",
+    "maxrects-cp",
+    "skyline",
+    "skyline-waste"
+};
+
+/* length of the overlap of [a0, a1) and [b0, b1) */
+int overlap(int a0, int a1, int b0, int b1)
+{
+    return std::max(0, std::min(a1, b1) - std::max(a0, b0));
+}
+
+
+/*--------------------------------------------------------------------------*
+ * Guillotine
+ *--------------------------------------------------------------------------*/
+
+/* free leaf of the guillotine tree */
+struct Node
+{
+    /* neighbouring free leaves in depth first order */
+    Node *prev, *next;
+
+    /*
+     * position of the leaf in depth first order. labels are spaced out so a
+     * new leaf can usually be given one without relabeling the others.
+     */
+    uint64_t order;
+
+    /* coordinates of the node relative to the root */
+    int x, y;
+
+    /* node's dimensions */
+    int width, height;
+};
+
+struct NodeOrder
+{
+    bool operator()(const Node *a, const Node *b) const
+    {
+        return a->order < b->order;
+    }
+};
+
+/* index of the highest set bit */
+int log2Floor(int v)
+{
+    int bits = 0;
+    while(v >>= 1)
+        bits++;
+    return bits;
+}
+
+/*
+ * Binary tree of nodes. A rectangle is put in the first free leaf, in depth
+ * first order, that it fits and the leaf is split in two. GUILLOTINE cuts
+ * along the side that leaves the larger remainder and GUILLOTINE_SHORTER along
+ * the other. GUILLOTINE_MAX_AREA makes the bigger of the two leftover
+ * rectangles as big as possible and GUILLOTINE_MIN_AREA as small as possible.
+ *
+ * Only the free leaves are kept. They are linked in depth first order and
+ * bucketed by the log2 of their width and height, each bucket sorted by
+ * order. A rectangle fits every leaf in a bucket above its own in both
+ * dimensions, so the first leaf of such a bucket is the only candidate there
+ * and only the buckets it shares a row or column with need to be searched
+ * leaf by leaf.
+ */
+class GuillotineEngine : public PackEngine, private boost::noncopyable
+{
+private:
+    typedef std::set<Node*, NodeOrder> Bucket;
+
+    static const uint64_t ORDER_END = static_cast<uint64_t>(1) << 63;
+
+    int                 split_rule;
+    bool                allow_rotation;
+    boost::object_pool<Node> node_pool;
+    Node                *first;
+    int                 num_free;
+
+    /* buckets[bw * bits + bh] holds leaves with log2 sizes bw and bh */
+    int                 bits;
+    std::vector<Bucket> buckets;
+
+    /* bit bh of row_mask[bw] is set if that bucket isn't empty */
+    std::vector<uint32_t> row_mask;
+
+public:
+    GuillotineEngine(int split_rule, int width, int height, bool allow_rotation)
+        : split_rule(split_rule), allow_rotation(allow_rotation)
+    {
+        bits = log2Floor(std::max(std::max(width, height), 1)) + 1;
+        buckets.resize(bits * bits);
+        row_mask.resize(bits, 0);
+
+        first    = NULL;
+        num_free = 0;
+
+        Node *root = createNode(0, 0, width, height);
+        root->order = 0;
+        link(root, NULL);
+    }
+
+    /* rotated when that fits a leaf earlier in depth first order */
+    bool insert(int width, int height, int &x, int &y, bool &rotated)
+    {
+        Node *node = findLeaf(width, height);
+        rotated = false;
+
+        if(allow_rotation && width != height)
+        {
+            Node *turned = findLeaf(height, width);
+
+            if(turned && (!node || turned->order < node->order))
+            {
+                node    = turned;
+                rotated = true;
+            }
+        }
+
+        if(!node)
+            return false;
+
+        node = rotated ? split(node, height, width) : split(node, width, height);
+        x = node->x;
+        y = node->y;
+        return true;
+    }
+
+    bool place(int, int, int, int)
+    {
+        return false;
+    }
+
+private:
+    /* returns the free leaf that comes first in depth first order and fits */
+    Node* findLeaf(int w, int h)
+    {
+        int bw = log2Floor(w);
+        int bh = log2Floor(h);
+        Node *best = NULL;
+
+        for(int i = bw; i < bits; i++)
+        {
+            for(int j = bh; j < bits; j++)
+            {
+                if(!(row_mask[i] & (1u << j)))
+                    continue;
+
+                Bucket &bucket = buckets[i * bits + j];
+
+                if(i > bw && j > bh)
+                {
+                    Node *n = *bucket.begin();
+                    if(!best || n->order < best->order)
+                        best = n;
+                    continue;
+                }
+
+                for(Bucket::iterator it = bucket.begin(); it != bucket.end(); ++it)
+                {
+                    Node *n = *it;
+                    if(best && n->order > best->order)
+                        break;
+
+                    if(w <= n->width && h <= n->height)
+                    {
+                        best = n;
+                        break;
+                    }
+                }
+            }
+        }
+
+        return best;
+    }
+
+    /*
+     * Splits a leaf the rectangle fits until it is exactly the rectangle's
+     * size and uses it. The leaf itself becomes the left child each time,
+     * keeping its place in depth first order, and the right child follows it.
+     */
+    Node* split(Node *node, int w, int h)
+    {
+        unindex(node);
+
+        while(w != node->width || h != node->height)
+        {
+            /*
+             * calculate the remaining width and height in the node. the node
+             * is guaranted to be bigger than the rectangle.
+             */
+            int rw = node->width  - w;
+            int rh = node->height - h;
+
+            if(splitVertically(node, rw, rh))
+            {
+                link(createNode(node->x + w, node->y, rw, node->height), node);
+                node->width = w;
+            }
+            else
+            {
+                link(createNode(node->x, node->y + h, node->width, rh), node);
+                node->height = h;
+            }
+        }
+
+        unlink(node);
+        return node;
+    }
+
+    /*
+     * True to cut a leaf at the right edge of the rectangle, leaving the part
+     * to its right the full height of the leaf, false to cut at its bottom
+     * edge. A side with nothing left over is never cut along.
+     */
+    bool splitVertically(const Node *node, int rw, int rh) const
+    {
+        if(rw == 0 || rh == 0)
+            return rw > rh;
+
+        uint64_t vertical   = static_cast<uint64_t>(rw) * node->height;
+        uint64_t horizontal = static_cast<uint64_t>(rh) * node->width;
+
+        switch(split_rule)
+        {
+            case GUILLOTINE_SHORTER:  return rw <= rh;
+            case GUILLOTINE_MAX_AREA: return vertical > horizontal;
+            case GUILLOTINE_MIN_AREA: return vertical <= horizontal;
+        }
+
+        return rw > rh;
+    }
+
+    /* links a new leaf after prev, or first if prev is NULL, and indexes it */
+    void link(Node *node, Node *prev)
+    {
+        Node *next = prev ? prev->next : first;
+
+        if(prev)
+        {
+            uint64_t end = next ? next->order : ORDER_END;
+            if(end - prev->order < 2)
+            {
+                relabel();
+                end = next ? next->order : ORDER_END;
+            }
+            node->order = prev->order + (end - prev->order) / 2;
+        }
+
+        node->prev = prev;
+        node->next = next;
+        if(prev)
+            prev->next = node;
+        else
+            first = node;
+        if(next)
+            next->prev = node;
+
+        num_free++;
+        index(node);
+    }
+
+    void unlink(Node *node)
+    {
+        if(node->prev)
+            node->prev->next = node->next;
+        else
+            first = node->next;
+        if(node->next)
+            node->next->prev = node->prev;
+
+        num_free--;
+    }
+
+    /*
+     * Spaces the labels out evenly. The order of the leaves doesn't change so
+     * the buckets stay sorted.
+     */
+    void relabel()
+    {
+        uint64_t step = ORDER_END / (num_free + 2);
+        uint64_t order = 0;
+
+        for(Node *n = first; n; n = n->next, order += step)
+            n->order = order;
+    }
+
+    void index(Node *node)
+    {
+        int i = log2Floor(node->width);
+        int j = log2Floor(node->height);
+
+        buckets[i * bits + j].insert(node);
+        row_mask[i] |= 1u << j;
+    }
+
+    void unindex(Node *node)
+    {
+        int i = log2Floor(node->width);
+        int j = log2Floor(node->height);
+        Bucket &bucket = buckets[i * bits + j];
+
+        bucket.erase(node);
+        if(bucket.empty())
+            row_mask[i] &= ~(1u << j);
+    }
+
+    Node* createNode(int x, int y, int w, int h)
+    {
+        Node *n = node_pool.construct();
+        n->prev = n->next = NULL;
+        n->order = 0;
+        n->x = x; n->y = y; n->width = w; n->height = h;
+        return n;
+    }
+};
+
+
+/*--------------------------------------------------------------------------*
+ * MaxRects
+ *--------------------------------------------------------------------------*/
+
+/*
+ * Free space is the set of maximal free rectangles, which may overlap. A
+ * rectangle is put at the top left of the free rectangle chosen by the
+ * heuristic and every free rectangle it overlaps is split around it.
+ */
+class MaxRectsEngine : public PackEngine
+{
+private:
+    int                 heuristic;
+    int                 sheet_width, sheet_height;
+    bool                allow_rotation;
+    std::vector<Rect>   free_rects;
+
+    /*
+     * rectangles placed so far indexed by the coordinate of each edge, so
+     * the rectangles touching an edge are found without a search. only kept
+     * for the contact point heuristic.
+     */
+    std::vector<Rect>                 used_rects;
+    std::vector< std::vector<int> >   by_left, by_right, by_top, by_bottom;
+
+    /* reused by occupy */
+    std::vector<Rect>   split;
+    std::vector<bool>   split_is_new;
+
+public:
+    MaxRectsEngine(int heuristic, int width, int height, bool allow_rotation)
+        : heuristic(heuristic), sheet_width(width), sheet_height(height), allow_rotation(allow_rotation)
+    {
+        free_rects.assign(1, makeRect(0, 0, width, height));
+
+        if(heuristic == MAXRECTS_CP)
+        {
+            by_left.resize(width + 1);
+            by_right.resize(width + 1);
+            by_top.resize(height + 1);
+            by_bottom.resize(height + 1);
+        }
+    }
+
+    /* rotated only when that scores strictly better */
+    bool insert(int width, int height, int &x, int &y, bool &rotated)
+    {
+        int best = -1;
+        long long best_primary = 0, best_secondary = 0;
+        int turns = allow_rotation && width != height ? 2 : 1;
+
+        rotated = false;
+
+        for(int turn = 0; turn < turns; turn++)
+        {
+            int w = turn ? height : width;
+            int h = turn ? width  : height;
+
+            for(int i = 0, n = free_rects.size(); i < n; i++)
+            {
+                const Rect &r = free_rects[i];
+
+                if(w > r.width || h > r.height)
+                    continue;
+
+                long long primary, secondary;
+                score(r, w, h, primary, secondary);
+
+                if(best < 0 || primary < best_primary || (primary == best_primary && secondary < best_secondary))
+                {
+                    best = i;
+                    best_primary = primary;
+                    best_secondary = secondary;
+                    rotated = turn != 0;
+                }
+            }
+        }
+
+        if(best < 0)
+            return false;
+
+        x = free_rects[best].x;
+        y = free_rects[best].y;
+        occupy(rotated ? makeRect(x, y, height, width) : makeRect(x, y, width, height));
+
+        return true;
+    }
+
+    bool place(int x, int y, int width, int height)
+    {
+        Rect r = makeRect(x, y, width, height);
+        bool is_free = false;
+
+        for(size_t i = 0; i < free_rects.size() && !is_free; i++)
+            is_free = rectContains(free_rects[i], r);
+
+        if(!is_free)
+            return false;
+
+        occupy(r);
+        return true;
+    }
+
+private:
+    /* lower scores are better. secondary breaks ties */
+    void score(const Rect &r, int w, int h, long long &primary, long long &secondary) const
+    {
+        int dw = r.width - w, dh = r.height - h;
+
+        switch(heuristic)
+        {
+            case MAXRECTS_BAF:
+                primary   = static_cast<long long>(r.width) * r.height - static_cast<long long>(w) * h;
+                secondary = std::min(dw, dh);
+                break;
+
+            case MAXRECTS_CP:
+                primary   = -contactLength(r.x, r.y, w, h);
+                secondary = 0;
+                break;
+
+            default:
+                primary   = std::min(dw, dh);
+                secondary = std::max(dw, dh);
+                break;
+        }
+    }
+
+    /* length of the rectangle's edges touching the sheet's edges or used rectangles */
+    long long contactLength(int x, int y, int w, int h) const
+    {
+        long long length = 0;
+
+        if(x == 0 || x + w == sheet_width)  length += h;
+        if(y == 0 || y + h == sheet_height) length += w;
+
+        length += verticalContact(by_left[x + w], y, y + h);
+        length += verticalContact(by_right[x],    y, y + h);
+        length += horizontalContact(by_top[y + h],  x, x + w);
+        length += horizontalContact(by_bottom[y],   x, x + w);
+
+        return length;
+    }
+
+    long long verticalContact(const std::vector<int> &rects, int y0, int y1) const
+    {
+        long long length = 0;
+        for(size_t i = 0; i < rects.size(); i++)
+            length += overlap(y0, y1, used_rects[rects[i]].y, used_rects[rects[i]].y + used_rects[rects[i]].height);
+        return length;
+    }
+
+    long long horizontalContact(const std::vector<int> &rects, int x0, int x1) const
+    {
+        long long length = 0;
+        for(size_t i = 0; i < rects.size(); i++)
+            length += overlap(x0, x1, used_rects[rects[i]].x, used_rects[rects[i]].x + used_rects[rects[i]].width);
+        return length;
+    }
+
+    /*
+     * Splits every free rectangle overlapping used in to the up to four
+     * maximal rectangles around it and then removes any rectangle contained
+     * in another. The free rectangles that don't overlap used were already
+     * pruned and can't be inside a piece split from another free rectangle,
+     * so only the new pieces are checked.
+     */
+    void occupy(const Rect &used)
+    {
+        if(heuristic == MAXRECTS_CP)
+        {
+            int index = used_rects.size();
+            used_rects.push_back(used);
+            by_left[used.x].push_back(index);
+            by_right[used.x + used.width].push_back(index);
+            by_top[used.y].push_back(index);
+            by_bottom[used.y + used.height].push_back(index);
+        }
+
+        split.clear();
+        split_is_new.clear();
+
+        for(size_t i = 0; i < free_rects.size(); i++)
+        {
+            const Rect &r = free_rects[i];
+
+            if(!rectIntersects(r, used))
+            {
+                split.push_back(r);
+                split_is_new.push_back(false);
+                continue;
+            }
+
+            if(used.x > r.x)
+                addSplit(makeRect(r.x, r.y, used.x - r.x, r.height));
+            if(used.x + used.width < r.x + r.width)
+                addSplit(makeRect(used.x + used.width, r.y, r.x + r.width - used.x - used.width, r.height));
+            if(used.y > r.y)
+                addSplit(makeRect(r.x, r.y, r.width, used.y - r.y));
+            if(used.y + used.height < r.y + r.height)
+                addSplit(makeRect(r.x, used.y + used.height, r.width, r.y + r.height - used.y - used.height));
+        }
+
+        free_rects.clear();
+
+        for(size_t i = 0; i < split.size(); i++)
+        {
+            bool contained = false;
+
+            for(size_t j = 0; j < split.size() && !contained && split_is_new[i]; j++)
+                if(i != j && rectContains(split[j], split[i]))
+                    contained = j < i || !rectContains(split[i], split[j]);
+
+            if(!contained)
+                free_rects.push_back(split[i]);
+        }
+    }
+
+    void addSplit(const Rect &r)
+    {
+        split.push_back(r);
+        split_is_new.push_back(true);
+    }
+};
+
+
+/*--------------------------------------------------------------------------*
+ * Skyline
+ *--------------------------------------------------------------------------*/
+
+/*
+ * The used area is described by its lower edge, the skyline, as a list of
+ * horizontal segments from left to right. A rectangle is put on top of the
+ * skyline where its bottom edge ends up highest in the sheet, which only
+ * needs a walk along the segments rather than a search of the free space.
+ *
+ * Space left under a rectangle that overhangs lower segments can't be
+ * reached from the skyline. With the waste map it is kept as free
+ * rectangles that are tried before the skyline.
+ */
+class SkylineEngine : public PackEngine
+{
+private:
+    struct Segment
+    {
+        int x, y;
+        int width;
+    };
+
+    int                     sheet_width, sheet_height;
+    bool                    use_waste_map;
+    bool                    allow_rotation;
+    std::vector<Segment>    skyline;
+    std::vector<Rect>       waste;
+
+public:
+    SkylineEngine(int width, int height, bool use_waste_map, bool allow_rotation)
+        : sheet_width(width), sheet_height(height), use_waste_map(use_waste_map), allow_rotation(allow_rotation)
+    {
+        Segment s = {0, 0, width};
+        skyline.assign(1, s);
+    }
+
+    /* rotated only when that ends up strictly lower or on a narrower segment */
+    bool insert(int width, int height, int &x, int &y, bool &rotated)
+    {
+        int turns = allow_rotation && width != height ? 2 : 1;
+
+        rotated = false;
+
+        if(use_waste_map && insertWaste(width, height, turns, x, y, rotated))
+            return true;
+
+        int best = -1;
+        int best_bottom = 0, best_width = 0;
+
+        for(int turn = 0; turn < turns; turn++)
+        {
+            int w = turn ? height : width;
+            int h = turn ? width  : height;
+
+            for(int i = 0, n = skyline.size(); i < n; i++)
+            {
+                int top;
+                if(!fits(i, w, h, top))
+                    continue;
+
+                if(best < 0 || top + h < best_bottom || (top + h == best_bottom && skyline[i].width < best_width))
+                {
+                    best = i;
+                    best_bottom = top + h;
+                    best_width = skyline[i].width;
+                    rotated = turn != 0;
+                }
+            }
+        }
+
+        if(best < 0)
+            return false;
+
+        if(rotated)
+            std::swap(width, height);
+
+        x = skyline[best].x;
+        y = best_bottom - height;
+
+        if(use_waste_map)
+            addWaste(best, x, y, width);
+
+        addLevel(best, x, y + height, width);
+        return true;
+    }
+
+    bool place(int, int, int, int)
+    {
+        return false;
+    }
+
+private:
+    /*
+     * Finds the top of a w by h rectangle starting at segment index: the
+     * lowest point of the skyline under it.
+     */
+    bool fits(int index, int w, int h, int &top) const
+    {
+        int x = skyline[index].x;
+        if(x + w > sheet_width)
+            return false;
+
+        top = 0;
+        for(int i = index, left = w; left > 0; i++)
+        {
+            top = std::max(top, skyline[i].y);
+            if(top + h > sheet_height)
+                return false;
+
+            left -= skyline[i].width;
+        }
+
+        return true;
+    }
+
+    /*
+     * Adds a segment at height y covering [x, x + w) in place of segment
+     * index and trims or removes the segments it covers.
+     */
+    void addLevel(int index, int x, int y, int w)
+    {
+        Segment s = {x, y, w};
+        skyline.insert(skyline.begin() + index, s);
+
+        size_t i = index + 1;
+        while(i < skyline.size() && skyline[i].x < x + w)
+        {
+            int shrink = x + w - skyline[i].x;
+
+            if(skyline[i].width <= shrink)
+            {
+                skyline.erase(skyline.begin() + i);
+                continue;
+            }
+
+            skyline[i].x     += shrink;
+            skyline[i].width -= shrink;
+            break;
+        }
+
+        /* neighbours at the same height become one segment */
+        for(i = 0; i + 1 < skyline.size(); )
+        {
+            if(skyline[i].y == skyline[i + 1].y)
+            {
+                skyline[i].width += skyline[i + 1].width;
+                skyline.erase(skyline.begin() + i + 1);
+            }
+            else
+                i++;
+        }
+    }
+
+    /* keeps the space between the segments under [x, x + w) and y */
+    void addWaste(int index, int x, int y, int w)
+    {
+        for(size_t i = index; i < skyline.size() && skyline[i].x < x + w; i++)
+        {
+            const Segment &s = skyline[i];
+            int x0 = std::max(s.x, x);
+            int x1 = std::min(s.x + s.width, x + w);
+
+            if(s.y < y && x0 < x1)
+                waste.push_back(makeRect(x0, s.y, x1 - x0, y - s.y));
+        }
+    }
+
+    /*
+     * Puts the rectangle in the waste rectangle leaving the least area over
+     * and splits what is left of it in two along the longer leftover side.
+     * With two turns a waste rectangle only the rotated rectangle fits is
+     * used too.
+     */
+    bool insertWaste(int w, int h, int turns, int &x, int &y, bool &rotated)
+    {
+        int best = -1;
+        long long best_area = 0;
+        bool best_rotated = false;
+
+        for(int i = 0, n = waste.size(); i < n; i++)
+        {
+            const Rect &r = waste[i];
+            bool turned = false;
+
+            if(w > r.width || h > r.height)
+            {
+                if(turns < 2 || h > r.width || w > r.height)
+                    continue;
+                turned = true;
+            }
+
+            long long area = static_cast<long long>(r.width) * r.height;
+            if(best < 0 || area < best_area)
+            {
+                best = i;
+                best_area = area;
+                best_rotated = turned;
+            }
+        }
+
+        if(best < 0)
+            return false;
+
+        rotated = best_rotated;
+        if(rotated)
+            std::swap(w, h);
+
+        Rect r = waste[best];
+        waste[best] = waste.back();
+        waste.pop_back();
+
+        x = r.x;
+        y = r.y;
+
+        int rw = r.width - w, rh = r.height - h;
+        Rect right, below;
+
+        if(rw > rh)
+        {
+            right = makeRect(r.x + w, r.y,     rw, r.height);
+            below = makeRect(r.x,     r.y + h, w,  rh);
+        }
+        else
+        {
+            right = makeRect(r.x + w, r.y,     rw,      h);
+            below = makeRect(r.x,     r.y + h, r.width, rh);
+        }
+
+        if(right.width > 0 && right.height > 0) waste.push_back(right);
+        if(below.width > 0 && below.height > 0) waste.push_back(below);
+
+        return true;
+    }
+};
+
+} /* end unnamed namespace */
+
+
+PackEngine* Imagepack::createPackEngine(int algorithm, int width, int height, bool allow_rotation)
+{
+    switch(algorithm)
+    {
+        case MAXRECTS_BSSF:
+        case MAXRECTS_BAF:
+        case MAXRECTS_CP:
+            return new MaxRectsEngine(algorithm, width, height, allow_rotation);
+
+        case SKYLINE:
+        case SKYLINE_WASTE:
+            return new SkylineEngine(width, height, algorithm == SKYLINE_WASTE, allow_rotation);
+    }
+
+    return new GuillotineEngine(algorithm, width, height, allow_rotation);
+}
+
+bool Imagepack::canPlace(int algorithm)
+{
+    return algorithm == MAXRECTS_BSSF || algorithm == MAXRECTS_BAF || algorithm == MAXRECTS_CP;
+}
+
+int Imagepack::parsePackAlgorithm(const std::string &name)
+{
+    for(int i = 0; i < NUM_PACK_ALGORITHMS; i++)
+        if(name == algorithm_names[i])
+            return i;
+
+    return -1;
+}
+
+const char* Imagepack::packAlgorithmName(int algorithm)
+{
+    if(algorithm < 0 || algorithm >= NUM_PACK_ALGORITHMS)
+        return "";
+
+    return algorithm_names[algorithm];
+}
@@ -0,0 +1,89 @@
+#ifndef PACK_ENGINE_H
+#define PACK_ENGINE_H
+
+#include <string>
+
+namespace Imagepack
+{
+
+/*--------------------------------------------------------------------------*
+ * Rect
+ *--------------------------------------------------------------------------*/
+struct Rect
+{
+    int x, y;
+    int width, height;
+};
+
+
+/*--------------------------------------------------------------------------*
+ * PackEngine
+ *--------------------------------------------------------------------------*/
+
+/*
+ * packing algorithms. the guillotine variants differ in which way a free leaf
+ * is split, the MaxRects variants in how a free rectangle is chosen and
+ * SKYLINE_WASTE adds a waste map to SKYLINE.
+ */
+enum
+{
+    GUILLOTINE,
+    GUILLOTINE_SHORTER,
+    GUILLOTINE_MAX_AREA,
+    GUILLOTINE_MIN_AREA,
+    MAXRECTS_BSSF,
+    MAXRECTS_BAF,
+    MAXRECTS_CP,
+    SKYLINE,
+    SKYLINE_WASTE,
+
+    NUM_PACK_ALGORITHMS
+};
+
+/*
+ * Tracks the free space of a sheet and decides where rectangles go. A sheet
+ * has one engine and asks it for a position for each image in turn.
+ */
+class PackEngine
+{
+public:
+    virtual         ~PackEngine() {}
+
+    /*
+     * Finds space for a width by height rectangle and marks it used. An
+     * engine created with rotation allowed may use height by width instead,
+     * if it fits better that way, and sets rotated. Returns false, leaving
+     * the engine unchanged, if there isn't room.
+     */
+    virtual bool    insert(int width, int height, int &x, int &y, bool &rotated) = 0;
+
+    /*
+     * Marks the rectangle at [x, y] as used. Returns false if any of it is
+     * outside the sheet or already used, or the engine can't place
+     * rectangles at arbitrary positions.
+     */
+    virtual bool    place(int x, int y, int width, int height) = 0;
+};
+
+/*
+ * returns a new engine for a width by height sheet. with allow_rotation the
+ * engine tries each rectangle both ways round.
+ */
+PackEngine* createPackEngine(int algorithm, int width, int height, bool allow_rotation=false);
+
+/* true if an engine of the algorithm supports PackEngine::place */
+bool        canPlace(int algorithm);
+
+/*
+ * Parses a name given to --algorithm: guillotine, guillotine-shorter,
+ * guillotine-max-area, guillotine-min-area, maxrects-bssf, maxrects-baf,
+ * maxrects-cp, skyline or skyline-waste. Returns -1 if the name isn't known.
+ */
+int         parsePackAlgorithm(const std::string &name);
+
+/* name of an algorithm as given to --algorithm */
+const char* packAlgorithmName(int algorithm);
+
+}
+
+#endif /* PACK_ENGINE_H */
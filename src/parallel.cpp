@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <boost/thread.hpp>
+#include <boost/bind/bind.hpp>
+#include "parallel.h"
+
+namespace {
+
+int jobs = 1;
+
+/*
+ * Shared state for a single parallelFor call. Workers take the next index
+ * until all have been handed out.
+ */
+struct WorkRange
+{
+    boost::mutex    mutex;
+    size_t          next;
+    size_t          count;
+};
+
+void worker(WorkRange *range, const boost::function<void (size_t)> *func)
+{
+    for(;;)
+    {
+        size_t i;
+
+        {
+            boost::lock_guard<boost::mutex> lock(range->mutex);
+            if(range->next >= range->count)
+                return;
+            i = range->next++;
+        }
+
+        (*func)(i);
+    }
+}
+
+} /* end unnamed namespace */
+
+
+namespace Imagepack
+{
+
+void setJobs(int n)
+{
+    if(n <= 0)
+        n = std::max(1u, boost::thread::hardware_concurrency());
+    jobs = n;
+}
+
+int numJobs()
+{
+    return jobs;
+}
+
+void parallelFor(size_t count, const boost::function<void (size_t)> &func)
+{
+    size_t num_threads = std::min(count, static_cast<size_t>(jobs));
+
+    if(num_threads <= 1)
+    {
+        for(size_t i = 0; i < count; i++)
+            func(i);
+        return;
+    }
+
+    WorkRange range;
+    range.next  = 0;
+    range.count = count;
+
+    boost::thread_group threads;
+    for(size_t i = 0; i < num_threads; i++)
+        threads.create_thread(boost::bind(worker, &range, &func));
+    threads.join_all();
+}
+
+MemoryBudget::MemoryBudget(size_t limit) : limit(limit), used(0) {}
+
+void MemoryBudget::acquire(size_t bytes)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+
+    if(limit != 0)
+        while(used != 0 && used + bytes > limit)
+            released.wait(lock);
+
+    used += bytes;
+}
+
+void MemoryBudget::release(size_t bytes)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        used -= std::min(used, bytes);
+    }
+
+    released.notify_all();
+}
+
+TaskQueue::TaskQueue(int num_threads) : closing(false)
+{
+    for(int i = 0; i < std::max(num_threads, 1); i++)
+        threads.create_thread(boost::bind(&TaskQueue::run, this));
+}
+
+TaskQueue::~TaskQueue()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        closing = true;
+    }
+
+    changed.notify_all();
+    threads.join_all();
+}
+
+void TaskQueue::push(const boost::function<void ()> &task)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        tasks.push_back(task);
+    }
+
+    changed.notify_one();
+}
+
+void TaskQueue::run()
+{
+    for(;;)
+    {
+        boost::function<void ()> task;
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+
+            while(tasks.empty() && !closing)
+                changed.wait(lock);
+
+            if(tasks.empty())
+                return;
+
+            task.swap(tasks.front());
+            tasks.pop_front();
+        }
+
+        task();
+    }
+}
+
+} /* end namespace Imagepack */
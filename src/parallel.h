@@ -0,0 +1,77 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <cstddef>
+#include <deque>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/utility.hpp>
+
+namespace Imagepack
+{
+
+/*
+ * Set the number of worker threads used for parallel work. 0 uses one thread
+ * per hardware thread and 1 runs everything on the calling thread.
+ */
+void setJobs(int jobs);
+int  numJobs();
+
+/*
+ * Calls func(i) for every i in [0, count). The calls are spread over
+ * numJobs() threads and return once all have finished. Calls may be made in
+ * any order so func must only touch data belonging to index i.
+ */
+void parallelFor(size_t count, const boost::function<void (size_t)> &func);
+
+/*
+ * Limits the memory used by work running on several threads. acquire blocks
+ * until the requested bytes fit in the limit. A request bigger than the whole
+ * limit is allowed once nothing else is held so it can't block forever. A
+ * limit of 0 disables the limit.
+ */
+class MemoryBudget : private boost::noncopyable
+{
+private:
+    boost::mutex                mutex;
+    boost::condition_variable   released;
+    size_t                      limit;
+    size_t                      used;
+
+public:
+    explicit MemoryBudget(size_t limit);
+
+    void acquire(size_t bytes);
+    void release(size_t bytes);
+};
+
+/*
+ * Runs tasks on background threads, started in the order they are pushed.
+ * Unlike parallelFor the work doesn't have to be known up front so tasks can
+ * be pushed as their input arrives. The destructor waits for every pushed
+ * task to finish.
+ */
+class TaskQueue : private boost::noncopyable
+{
+private:
+    boost::mutex                            mutex;
+    boost::condition_variable               changed;
+    std::deque< boost::function<void ()> >  tasks;
+    boost::thread_group                     threads;
+    bool                                    closing;
+
+public:
+    explicit TaskQueue(int num_threads);
+    ~TaskQueue();
+
+    void push(const boost::function<void ()> &task);
+
+private:
+    void run();
+};
+
+}
+
+#endif /* PARALLEL_H */
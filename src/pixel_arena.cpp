@@ -0,0 +1,136 @@
+#include <cstdlib>
+#include <algorithm>
+#include <new>
+#include "pixel_arena.h"
+
+using namespace Imagepack;
+
+
+PixelArena::PixelArena()
+{
+    for(int i = 0; i < NUM_SIZE_CLASSES; i++)
+        classes[i].next = classes[i].end = NULL;
+
+    reserved = 0;
+    used     = 0;
+}
+
+PixelArena::~PixelArena()
+{
+    for(size_t i = 0; i < slabs.size(); i++)
+        std::free(slabs[i]);
+}
+
+void* PixelArena::allocate(size_t size)
+{
+    if(size == 0)
+        return NULL;
+
+    int c = classOf(size);
+
+    if(c < 0)
+    {
+        void *block = std::malloc(size);
+        if(!block)
+            throw std::bad_alloc();
+
+        boost::mutex::scoped_lock lock(mutex);
+        reserved += size;
+        used     += size;
+        return block;
+    }
+
+    size_t block_size = classSize(c);
+    SizeClass &sc = classes[c];
+    boost::mutex::scoped_lock lock(mutex);
+
+    used += block_size;
+
+    if(!sc.free_blocks.empty())
+    {
+        char *block = sc.free_blocks.back();
+        sc.free_blocks.pop_back();
+        return block;
+    }
+
+    if(sc.next == NULL || static_cast<size_t>(sc.end - sc.next) < block_size)
+    {
+        size_t slab_size = slabSize(c);
+        char *slab = static_cast<char*>(std::malloc(slab_size));
+        if(!slab)
+        {
+            used -= block_size;
+            throw std::bad_alloc();
+        }
+
+        slabs.push_back(slab);
+        reserved += slab_size;
+        sc.next = slab;
+        sc.end  = slab + slab_size;
+    }
+
+    char *block = sc.next;
+    sc.next += block_size;
+    return block;
+}
+
+void PixelArena::release(void *block, size_t size)
+{
+    if(!block)
+        return;
+
+    int c = classOf(size);
+
+    if(c < 0)
+    {
+        std::free(block);
+
+        boost::mutex::scoped_lock lock(mutex);
+        reserved -= size;
+        used     -= size;
+        return;
+    }
+
+    boost::mutex::scoped_lock lock(mutex);
+    classes[c].free_blocks.push_back(static_cast<char*>(block));
+    used -= classSize(c);
+}
+
+size_t PixelArena::reservedBytes()
+{
+    boost::mutex::scoped_lock lock(mutex);
+    return reserved;
+}
+
+size_t PixelArena::usedBytes()
+{
+    boost::mutex::scoped_lock lock(mutex);
+    return used;
+}
+
+/*
+ * Classes go up in steps of 1.5 and 2 alternately: 64, 96, 128, 192, 256...
+ * so no more than a third of a block is wasted. The largest class is 256KB.
+ */
+size_t PixelArena::classSize(int size_class)
+{
+    size_t base = static_cast<size_t>(MIN_CLASS_SIZE) << (size_class / 2);
+    return size_class % 2 ? base + base / 2 : base;
+}
+
+/*
+ * Small classes share a minimum slab size so a class that is only used a few
+ * times doesn't hold much unused memory.
+ */
+size_t PixelArena::slabSize(int size_class)
+{
+    return std::max<size_t>(MIN_SLAB_SIZE, classSize(size_class) * BLOCKS_PER_SLAB);
+}
+
+int PixelArena::classOf(size_t size)
+{
+    for(int c = 0; c < NUM_SIZE_CLASSES; c++)
+        if(classSize(c) >= size)
+            return c;
+    return -1;
+}
@@ -0,0 +1,70 @@
+#ifndef PIXEL_ARENA_H
+#define PIXEL_ARENA_H
+
+#include <cstddef>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+
+namespace Imagepack
+{
+
+/*
+ * Allocates pixel buffers from slabs. Requests are rounded up to a size
+ * class and freed blocks are kept on a list per class so images that are
+ * unloaded and loaded again reuse the same memory rather than going back to
+ * the heap. Requests bigger than the largest class are passed to malloc.
+ * Slabs are only freed when the arena is destroyed.
+ *
+ * Blocks can be allocated and released from any thread.
+ */
+class PixelArena : private boost::noncopyable
+{
+public:
+    enum
+    {
+        MIN_CLASS_SIZE   = 64,
+        NUM_SIZE_CLASSES = 25,
+        MIN_SLAB_SIZE    = 64 * 1024,
+        BLOCKS_PER_SLAB  = 4
+    };
+
+private:
+    struct SizeClass
+    {
+        std::vector<char*>  free_blocks;
+
+        /* unused end of the slab this class is carving blocks from */
+        char                *next;
+        char                *end;
+    };
+
+    boost::mutex            mutex;
+    SizeClass               classes[NUM_SIZE_CLASSES];
+    std::vector<char*>      slabs;
+    size_t                  reserved;
+    size_t                  used;
+
+public:
+                    PixelArena();
+                    ~PixelArena();
+
+    void*           allocate(size_t size);
+    void            release(void *block, size_t size);
+
+    /* bytes taken from the heap, including slabs not yet handed out */
+    size_t          reservedBytes();
+
+    /* bytes in blocks currently allocated, rounded up to their size class */
+    size_t          usedBytes();
+
+    static size_t   classSize(int size_class);
+    static size_t   slabSize(int size_class);
+
+private:
+    static int      classOf(size_t size);
+};
+
+}
+
+#endif /* PIXEL_ARENA_H */
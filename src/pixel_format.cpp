@@ -0,0 +1,112 @@
+#include <algorithm>
+#include "pixel_format.h"
+
+using namespace Imagepack;
+
+
+namespace {
+
+template<class From>
+void convertFrom(const uint8_t *src, uint8_t *dst, int dst_format, int count)
+{
+    switch(dst_format)
+    {
+        case GRAY8:       convertPixelsT<From, Gray8Format>(src, dst, count);      break;
+        case GRAY_ALPHA8: convertPixelsT<From, GrayAlpha8Format>(src, dst, count); break;
+        case RGBA8:       convertPixelsT<From, Rgba8Format>(src, dst, count);      break;
+        case RGBA16:      convertPixelsT<From, Rgba16Format>(src, dst, count);     break;
+    }
+}
+
+/*
+ * Tries each narrower format in turn. Most images fail the narrowest test on
+ * the first few pixels so this rarely reads an image more than once.
+ */
+template<class From>
+int narrowestFrom(const uint8_t *src, int count)
+{
+    int from = From::format;
+
+    if(from > GRAY8 && fitsFormatT<From, Gray8Format>(src, count))
+        return GRAY8;
+    if(from > GRAY_ALPHA8 && fitsFormatT<From, GrayAlpha8Format>(src, count))
+        return GRAY_ALPHA8;
+    if(from > RGBA8 && fitsFormatT<From, Rgba8Format>(src, count))
+        return RGBA8;
+    return from;
+}
+
+} /* end unnamed namespace */
+
+
+int Imagepack::pixelSize(int format)
+{
+    switch(format)
+    {
+        case GRAY8:       return Gray8Format::size;
+        case GRAY_ALPHA8: return GrayAlpha8Format::size;
+        case RGBA8:       return Rgba8Format::size;
+        case RGBA16:      return Rgba16Format::size;
+    }
+    return 0;
+}
+
+int Imagepack::widerFormat(int a, int b)
+{
+    return std::max(a, b);
+}
+
+const char* Imagepack::formatName(int format)
+{
+    switch(format)
+    {
+        case GRAY8:       return "gray8";
+        case GRAY_ALPHA8: return "gray-alpha8";
+        case RGBA8:       return "rgba8";
+        case RGBA16:      return "rgba16";
+    }
+    return "unknown";
+}
+
+void Imagepack::convertPixels(const uint8_t *src, int src_format, uint8_t *dst, int dst_format, int count)
+{
+    if(src_format == dst_format)
+    {
+        std::memcpy(dst, src, static_cast<size_t>(count) * pixelSize(src_format));
+        return;
+    }
+
+    switch(src_format)
+    {
+        case GRAY8:       convertFrom<Gray8Format>(src, dst, dst_format, count);      break;
+        case GRAY_ALPHA8: convertFrom<GrayAlpha8Format>(src, dst, dst_format, count); break;
+        case RGBA8:       convertFrom<Rgba8Format>(src, dst, dst_format, count);      break;
+        case RGBA16:      convertFrom<Rgba16Format>(src, dst, dst_format, count);     break;
+    }
+}
+
+int Imagepack::narrowestFormat(const uint8_t *src, int format, int count)
+{
+    switch(format)
+    {
+        case GRAY_ALPHA8: return narrowestFrom<GrayAlpha8Format>(src, count);
+        case RGBA8:       return narrowestFrom<Rgba8Format>(src, count);
+        case RGBA16:      return narrowestFrom<Rgba16Format>(src, count);
+    }
+    return format;
+}
+
+bool Imagepack::findOpaque(const uint8_t *src, int format, int count, int &first, int &last)
+{
+    switch(format)
+    {
+        case GRAY_ALPHA8: return findOpaqueT<GrayAlpha8Format>(src, count, first, last);
+        case RGBA8:       return findOpaqueT<Rgba8Format>(src, count, first, last);
+        case RGBA16:      return findOpaqueT<Rgba16Format>(src, count, first, last);
+    }
+
+    /* formats without alpha are always opaque */
+    first = 0;
+    last  = count - 1;
+    return count > 0;
+}
@@ -0,0 +1,187 @@
+#ifndef PIXEL_FORMAT_H
+#define PIXEL_FORMAT_H
+
+#include <cstddef>
+#include <cstring>
+#include <boost/cstdint.hpp>
+
+namespace Imagepack
+{
+
+/*
+ * Pixel formats from narrowest to widest. Every format can be converted to a
+ * wider one without losing anything so the widest of two formats holds both.
+ */
+enum PixelFormat
+{
+    GRAY8,          /* 1 byte luminance, always opaque */
+    GRAY_ALPHA8,    /* 1 byte luminance then 1 byte alpha */
+    RGBA8,          /* a packed 0xRRGGBBAA uint32_t, the same as Pixel32 */
+    RGBA16,         /* 4 uint16_t in red, green, blue, alpha order */
+
+    NUM_PIXEL_FORMATS
+};
+
+int         pixelSize(int format);
+int         widerFormat(int a, int b);
+const char* formatName(int format);
+
+/*
+ * Converts count pixels from one format to another. src and dst must not
+ * overlap.
+ */
+void convertPixels(const uint8_t *src, int src_format, uint8_t *dst, int dst_format, int count);
+
+/*
+ * Returns the narrowest format that holds count pixels of the given format
+ * without loss.
+ */
+int narrowestFormat(const uint8_t *src, int format, int count);
+
+/*
+ * Finds the first and last of count pixels with a non zero alpha. Returns
+ * false if every pixel is transparent.
+ */
+bool findOpaque(const uint8_t *src, int format, int count, int &first, int &last);
+
+
+/*
+ * Format traits used by the conversion kernels. Each format loads to and
+ * stores from 16 bit RGBA. 8 bit values v become v*257 so converting to 16
+ * bits and back is exact.
+ */
+struct Rgba16
+{
+    uint16_t r, g, b, a;
+};
+
+struct Gray8Format
+{
+    enum { format = GRAY8, size = 1 };
+
+    static Rgba16 load(const uint8_t *p)
+    {
+        uint16_t v = static_cast<uint16_t>(p[0] * 257);
+        Rgba16 c = {v, v, v, 65535};
+        return c;
+    }
+
+    static void store(uint8_t *p, const Rgba16 &c)
+    {
+        p[0] = static_cast<uint8_t>(c.r >> 8);
+    }
+
+    static bool exact(const Rgba16 &c)
+    {
+        return c.r == c.g && c.r == c.b && c.a == 65535 && c.r % 257 == 0;
+    }
+};
+
+struct GrayAlpha8Format
+{
+    enum { format = GRAY_ALPHA8, size = 2 };
+
+    static Rgba16 load(const uint8_t *p)
+    {
+        uint16_t v = static_cast<uint16_t>(p[0] * 257);
+        Rgba16 c = {v, v, v, static_cast<uint16_t>(p[1] * 257)};
+        return c;
+    }
+
+    static void store(uint8_t *p, const Rgba16 &c)
+    {
+        p[0] = static_cast<uint8_t>(c.r >> 8);
+        p[1] = static_cast<uint8_t>(c.a >> 8);
+    }
+
+    static bool exact(const Rgba16 &c)
+    {
+        return c.r == c.g && c.r == c.b && c.r % 257 == 0 && c.a % 257 == 0;
+    }
+};
+
+struct Rgba8Format
+{
+    enum { format = RGBA8, size = 4 };
+
+    static Rgba16 load(const uint8_t *p)
+    {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        Rgba16 c = {static_cast<uint16_t>(((v >> 24) & 0xFF) * 257), static_cast<uint16_t>(((v >> 16) & 0xFF) * 257),
+                    static_cast<uint16_t>(((v >>  8) & 0xFF) * 257), static_cast<uint16_t>(((v >>  0) & 0xFF) * 257)};
+        return c;
+    }
+
+    static void store(uint8_t *p, const Rgba16 &c)
+    {
+        uint32_t v = (static_cast<uint32_t>(c.r >> 8) << 24) | (static_cast<uint32_t>(c.g >> 8) << 16) |
+                     (static_cast<uint32_t>(c.b >> 8) <<  8) | (static_cast<uint32_t>(c.a >> 8) <<  0);
+        std::memcpy(p, &v, sizeof(v));
+    }
+
+    static bool exact(const Rgba16 &c)
+    {
+        return c.r % 257 == 0 && c.g % 257 == 0 && c.b % 257 == 0 && c.a % 257 == 0;
+    }
+};
+
+struct Rgba16Format
+{
+    enum { format = RGBA16, size = 8 };
+
+    static Rgba16 load(const uint8_t *p)
+    {
+        Rgba16 c;
+        std::memcpy(&c, p, sizeof(c));
+        return c;
+    }
+
+    static void store(uint8_t *p, const Rgba16 &c)
+    {
+        std::memcpy(p, &c, sizeof(c));
+    }
+
+    static bool exact(const Rgba16 &)
+    {
+        return true;
+    }
+};
+
+template<class From, class To>
+void convertPixelsT(const uint8_t *src, uint8_t *dst, int count)
+{
+    for(int i = 0; i < count; i++, src += From::size, dst += To::size)
+        To::store(dst, From::load(src));
+}
+
+/* true if every pixel can be stored in Narrow without loss */
+template<class From, class Narrow>
+bool fitsFormatT(const uint8_t *src, int count)
+{
+    for(int i = 0; i < count; i++, src += From::size)
+        if(!Narrow::exact(From::load(src)))
+            return false;
+    return true;
+}
+
+template<class Format>
+bool findOpaqueT(const uint8_t *src, int count, int &first, int &last)
+{
+    first = 0;
+    while(first < count && Format::load(src + first * Format::size).a == 0)
+        first++;
+
+    if(first == count)
+        return false;
+
+    last = count - 1;
+    while(Format::load(src + last * Format::size).a == 0)
+        last--;
+
+    return true;
+}
+
+}
+
+#endif /* PIXEL_FORMAT_H */
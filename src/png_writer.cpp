@@ -0,0 +1,299 @@
+#include <cstdlib>
+#include <cstring>
+#include <boost/static_assert.hpp>
+#include "output.h"
+#include "image_io.h"
+#include "imagepack.h"
+#include "png_writer.h"
+
+using boost::format;
+using namespace Imagepack;
+
+
+namespace {
+
+/* RGBA8 rows are read as packed 0xRRGGBBAA values */
+BOOST_STATIC_ASSERT(sizeof(Pixel) == sizeof(uint32_t));
+
+const unsigned char png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+
+/* size of the compressed data written in each IDAT chunk */
+const size_t idat_size = 64 * 1024;
+
+void putU32(unsigned char *p, uint32_t v)
+{
+    p[0] = static_cast<unsigned char>(v >> 24);
+    p[1] = static_cast<unsigned char>(v >> 16);
+    p[2] = static_cast<unsigned char>(v >>  8);
+    p[3] = static_cast<unsigned char>(v >>  0);
+}
+
+unsigned char paeth(int a, int b, int c)
+{
+    int p  = a + b - c;
+    int pa = std::abs(p - a);
+    int pb = std::abs(p - b);
+    int pc = std::abs(p - c);
+
+    if(pa <= pb && pa <= pc) return static_cast<unsigned char>(a);
+    if(pb <= pc)             return static_cast<unsigned char>(b);
+    return static_cast<unsigned char>(c);
+}
+
+/*
+ * Sum of the filtered bytes treated as signed values. Used to pick the filter
+ * that is likely to compress best, the same heuristic libpng uses.
+ */
+unsigned long filterCost(const std::vector<unsigned char> &row)
+{
+    unsigned long sum = 0;
+    for(size_t i = 1, n = row.size(); i < n; i++)
+        sum += row[i] < 128 ? row[i] : 256 - row[i];
+    return sum;
+}
+
+} /* end unnamed namespace */
+
+
+PngWriter::PngWriter()
+{
+    file         = NULL;
+    stream_open  = false;
+    width        = 0;
+    height       = 0;
+    pixel_format = RGBA8;
+    bpp          = 4;
+    rows_written = 0;
+    failed       = false;
+}
+
+PngWriter::~PngWriter()
+{
+    abort();
+}
+
+bool PngWriter::open(const boost::filesystem::path &path, int width, int height, int pixel_format)
+{
+    abort();
+
+    this->width        = width;
+    this->height       = height;
+    this->pixel_format = pixel_format;
+    bpp                = pixelSize(pixel_format);
+    rows_written       = 0;
+    failed             = false;
+
+    size_t row_bytes = static_cast<size_t>(width) * bpp;
+    prev_row.assign(row_bytes, 0);
+    cur_row.assign(row_bytes, 0);
+    for(int i = 0; i < 5; i++)
+        filtered[i].assign(row_bytes + 1, static_cast<unsigned char>(i));
+    out_buffer.resize(idat_size);
+
+    std::memset(&stream, 0, sizeof(stream));
+    if(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15, 8, Z_FILTERED) != Z_OK)
+        return false;
+    stream_open       = true;
+    stream.next_out   = &out_buffer[0];
+    stream.avail_out  = static_cast<uInt>(out_buffer.size());
+
+    print(format("writing %s\n") % path, VERBOSE);
+
+    if(!writeEnabled())
+        return true;
+
+    file = std::fopen(path.string().c_str(), "wb");
+
+    if(!file)
+    {
+        print("failed to write image\n", VERBOSE);
+        abort();
+        return false;
+    }
+
+    unsigned char ihdr[13];
+    putU32(ihdr + 0, width);
+    putU32(ihdr + 4, height);
+    ihdr[8]  = pixel_format == RGBA16 ? 16 : 8;  /* bit depth */
+    ihdr[9]  = pixel_format == GRAY8 ? 0 : pixel_format == GRAY_ALPHA8 ? 4 : 6;  /* colour type gray, gray alpha or RGBA */
+    ihdr[10] = 0;  /* deflate */
+    ihdr[11] = 0;  /* adaptive filtering */
+    ihdr[12] = 0;  /* no interlace */
+
+    if(std::fwrite(png_signature, 1, sizeof(png_signature), file) != sizeof(png_signature) || !writeChunk("IHDR", ihdr, sizeof(ihdr)))
+    {
+        abort();
+        return false;
+    }
+
+    return true;
+}
+
+bool PngWriter::writeRows(const PixelData &pixels, int first_row, int count)
+{
+    if(!stream_open || failed || pixels.width() != width || pixels.format() != pixel_format || rows_written + count > height)
+        return false;
+
+    for(int y = first_row; y < first_row + count; y++)
+    {
+        /* PNG stores samples most significant byte first */
+        if(pixel_format == RGBA8)
+        {
+            const uint32_t *src = reinterpret_cast<const uint32_t*>(pixels.row(y));
+
+            for(int x = 0; x < width; x++)
+                putU32(&cur_row[x*bpp], src[x]);
+        }
+        else if(pixel_format == RGBA16)
+        {
+            const uint16_t *src = reinterpret_cast<const uint16_t*>(pixels.row(y));
+
+            for(int x = 0; x < width*4; x++)
+            {
+                cur_row[x*2 + 0] = static_cast<unsigned char>(src[x] >> 8);
+                cur_row[x*2 + 1] = static_cast<unsigned char>(src[x]);
+            }
+        }
+        else
+            std::memcpy(&cur_row[0], pixels.row(y), cur_row.size());
+
+        if(!filterRow())
+        {
+            failed = true;
+            return false;
+        }
+
+        cur_row.swap(prev_row);
+        rows_written++;
+    }
+
+    return true;
+}
+
+bool PngWriter::close()
+{
+    bool ok = stream_open && !failed && rows_written == height && compress(NULL, 0, Z_FINISH);
+
+    if(ok && file)
+        ok = writeChunk("IEND", NULL, 0) && std::fclose(file) == 0;
+    else if(file)
+        std::fclose(file);
+    file = NULL;
+
+    if(!ok)
+        print("failed to write image\n", VERBOSE);
+
+    abort();
+    return ok;
+}
+
+/*
+ * Filters cur_row with each of the five PNG filters against prev_row and
+ * compresses the one with the lowest cost. Returns false if compressing or
+ * writing the compressed data failed.
+ */
+bool PngWriter::filterRow()
+{
+    const unsigned char *row  = &cur_row[0];
+    const unsigned char *prev = &prev_row[0];
+    size_t n = cur_row.size();
+
+    unsigned char *none  = &filtered[0][1];
+    unsigned char *sub   = &filtered[1][1];
+    unsigned char *up    = &filtered[2][1];
+    unsigned char *avg   = &filtered[3][1];
+    unsigned char *paeth_row = &filtered[4][1];
+
+    /* prev_row is all zero for the first row which is what PNG expects */
+    for(size_t i = 0; i < n; i++)
+    {
+        int a = i >= bpp ? row[i-bpp]  : 0;
+        int b = prev[i];
+        int c = i >= bpp ? prev[i-bpp] : 0;
+
+        none[i]      = row[i];
+        sub[i]       = static_cast<unsigned char>(row[i] - a);
+        up[i]        = static_cast<unsigned char>(row[i] - b);
+        avg[i]       = static_cast<unsigned char>(row[i] - ((a + b) >> 1));
+        paeth_row[i] = static_cast<unsigned char>(row[i] - paeth(a, b, c));
+    }
+
+    int best = 0;
+    unsigned long best_cost = filterCost(filtered[0]);
+
+    for(int f = 1; f < 5; f++)
+    {
+        unsigned long cost = filterCost(filtered[f]);
+        if(cost < best_cost)
+        {
+            best = f;
+            best_cost = cost;
+        }
+    }
+
+    return compress(&filtered[best][0], filtered[best].size(), Z_NO_FLUSH);
+}
+
+/*
+ * Feeds data to the deflate stream and writes an IDAT chunk whenever the
+ * output buffer fills up. Z_FINISH flushes everything that's left.
+ */
+bool PngWriter::compress(const unsigned char *data, size_t size, int flush)
+{
+    stream.next_in  = const_cast<Bytef*>(data);
+    stream.avail_in = static_cast<uInt>(size);
+
+    for(;;)
+    {
+        int result = deflate(&stream, flush);
+
+        if(result == Z_STREAM_ERROR)
+            return false;
+
+        bool full = stream.avail_out == 0;
+        bool done = flush == Z_FINISH ? result == Z_STREAM_END : stream.avail_in == 0;
+
+        if(full || (done && flush == Z_FINISH))
+        {
+            size_t used = out_buffer.size() - stream.avail_out;
+
+            if(used > 0 && file && !writeChunk("IDAT", &out_buffer[0], used))
+                return false;
+
+            stream.next_out  = &out_buffer[0];
+            stream.avail_out = static_cast<uInt>(out_buffer.size());
+        }
+
+        if(done && !full)
+            return true;
+    }
+}
+
+bool PngWriter::writeChunk(const char *type, const unsigned char *data, size_t size)
+{
+    unsigned char header[8];
+    putU32(header, static_cast<uint32_t>(size));
+    std::memcpy(header + 4, type, 4);
+
+    uLong crc = crc32(0, header + 4, 4);
+    if(size > 0)
+        crc = crc32(crc, data, static_cast<uInt>(size));
+
+    unsigned char footer[4];
+    putU32(footer, static_cast<uint32_t>(crc));
+
+    return std::fwrite(header, 1, 8, file) == 8 &&
+           (size == 0 || std::fwrite(data, 1, size, file) == size) &&
+           std::fwrite(footer, 1, 4, file) == 4;
+}
+
+void PngWriter::abort()
+{
+    if(stream_open)
+        deflateEnd(&stream);
+    stream_open = false;
+
+    if(file)
+        std::fclose(file);
+    file = NULL;
+}
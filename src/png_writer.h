@@ -0,0 +1,58 @@
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+#include <cstdio>
+#include <vector>
+#include <zlib.h>
+#include <boost/filesystem.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/utility.hpp>
+
+namespace Imagepack
+{
+
+class PixelData;
+
+/*
+ * Writes a PNG in any PixelFormat a few rows at a time. Rows are filtered and
+ * compressed as they are given so only the current and previous rows are kept
+ * in memory. Nothing is written to disk if writing is disabled in image_io.
+ */
+class PngWriter : private boost::noncopyable
+{
+private:
+    FILE                        *file;
+    z_stream                    stream;
+    bool                        stream_open;
+    int                         width;
+    int                         height;
+    int                         pixel_format;
+    size_t                      bpp;
+    int                         rows_written;
+
+    /* set when compressing or writing rows fails. reported by close */
+    bool                        failed;
+
+    std::vector<unsigned char>  prev_row;
+    std::vector<unsigned char>  cur_row;
+    std::vector<unsigned char>  filtered[5];
+    std::vector<unsigned char>  out_buffer;
+
+public:
+                    PngWriter();
+                    ~PngWriter();
+
+    bool            open(const boost::filesystem::path &path, int width, int height, int pixel_format);
+    bool            writeRows(const PixelData &pixels, int first_row, int count);
+    bool            close();
+
+private:
+    bool            compress(const unsigned char *data, size_t size, int flush);
+    bool            writeChunk(const char *type, const unsigned char *data, size_t size);
+    bool            filterRow();
+    void            abort();
+};
+
+}
+
+#endif /* PNG_WRITER_H */
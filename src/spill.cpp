@@ -0,0 +1,120 @@
+#include "output.h"
+#include "imagepack.h"
+#include "spill.h"
+
+using boost::format;
+using namespace Imagepack;
+
+namespace fs = boost::filesystem;
+
+
+namespace {
+
+/* each image starts on a cache line */
+const boost::uint64_t alignment = 64;
+
+} /* end unnamed namespace */
+
+
+SpillFile::SpillFile()
+{
+    file = NULL;
+    size = 0;
+}
+
+SpillFile::~SpillFile()
+{
+    close();
+}
+
+bool SpillFile::open()
+{
+    close();
+
+    boost::system::error_code ec;
+    path = fs::temp_directory_path(ec) / fs::unique_path("imagepack-%%%%-%%%%-%%%%.spill");
+    file = std::fopen(path.string().c_str(), "w+b");
+
+    if(!file)
+    {
+        print(format("failed to create spill file %s\n") % path);
+        return false;
+    }
+
+    print(format("spilling image data to %s\n") % path, VERBOSE);
+    return true;
+}
+
+/*
+ * Appends the pixel rows and returns their offset in the file.
+ */
+boost::uint64_t SpillFile::write(const PixelData &pixels)
+{
+    boost::mutex::scoped_lock lock(mutex);
+
+    if(map.is_open())
+        map.close();
+
+    static const char padding[alignment] = {0};
+    size_t pad = static_cast<size_t>((alignment - size % alignment) % alignment);
+
+    if(std::fwrite(padding, 1, pad, file) != pad)
+        fatal(format("failed to write spill file %s\n") % path);
+
+    size += pad;
+    boost::uint64_t offset = size;
+    size_t row_bytes = pixels.rowBytes();
+
+    for(int y = 0; y < pixels.height(); y++)
+        if(std::fwrite(pixels.row(y), 1, row_bytes, file) != row_bytes)
+            fatal(format("failed to write spill file %s\n") % path);
+
+    size += static_cast<boost::uint64_t>(row_bytes) * pixels.height();
+    return offset;
+}
+
+/*
+ * Points pixels at width*height pixels of the given format stored at offset
+ * without copying them.
+ */
+bool SpillFile::view(boost::uint64_t offset, int width, int height, int pixel_format, PixelData &pixels)
+{
+    boost::mutex::scoped_lock lock(mutex);
+    size_t row_bytes = static_cast<size_t>(width) * pixelSize(pixel_format);
+
+    if(!file || offset + static_cast<boost::uint64_t>(row_bytes) * height > size)
+        return false;
+
+    if(!map.is_open())
+    {
+        std::fflush(file);
+        map.open(path.string(), static_cast<size_t>(size));
+
+        if(!map.is_open())
+            return fatal(format("failed to map spill file %s\n") % path);
+    }
+
+    pixels.view(map.data() + offset, width, height, row_bytes, pixel_format);
+    return true;
+}
+
+boost::uint64_t SpillFile::bytesWritten() const
+{
+    return size;
+}
+
+void SpillFile::close()
+{
+    if(map.is_open())
+        map.close();
+
+    if(file)
+    {
+        std::fclose(file);
+        boost::system::error_code ec;
+        fs::remove(path, ec);
+    }
+
+    file = NULL;
+    size = 0;
+}
@@ -0,0 +1,45 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <cstdio>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/utility.hpp>
+
+namespace Imagepack
+{
+
+class PixelData;
+
+/*
+ * A temporary file that decoded pixel data is written to once and then read
+ * back through a read only memory map. Views into the map are only valid until
+ * the next write since the file is remapped when it grows.
+ */
+class SpillFile : private boost::noncopyable
+{
+private:
+    boost::filesystem::path                     path;
+    FILE                                        *file;
+    boost::iostreams::mapped_file_source        map;
+    boost::uint64_t                             size;
+    boost::mutex                                mutex;
+
+public:
+                    SpillFile();
+                    ~SpillFile();
+
+    bool            open();
+    boost::uint64_t write(const PixelData &pixels);
+    bool            view(boost::uint64_t offset, int width, int height, int pixel_format, PixelData &pixels);
+    boost::uint64_t bytesWritten() const;
+
+private:
+    void            close();
+};
+
+}
+
+#endif /* SPILL_H */